@@ -0,0 +1,16 @@
+#ifndef _ALLOC_COUNTER_H_
+#define _ALLOC_COUNTER_H_
+
+#include <cstdint>
+
+/* Number of heap allocations made by the calling thread so far. Only
+ * counted when built with MCMQ_COUNT_ALLOCATIONS, which links
+ * alloc_counter.cpp and its replacement of the global operator new;
+ * always 0 otherwise. */
+#ifdef MCMQ_COUNT_ALLOCATIONS
+uint64_t thread_heap_allocations();
+#else
+inline uint64_t thread_heap_allocations() { return 0; }
+#endif
+
+#endif
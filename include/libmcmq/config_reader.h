@@ -15,6 +15,19 @@ struct NamespaceDefinition {
     {}
 };
 
+/* Namespace nsid of a device in the order given on the command line. */
+struct VolumeMember {
+    unsigned int device;
+    unsigned int nsid;
+};
+
+/* RAID-0 volume that flows address as namespace nsid. */
+struct VolumeDefinition {
+    unsigned int nsid;
+    size_t stripe_size;
+    std::vector<VolumeMember> members;
+};
+
 enum class FlowType {
     SYNTHETIC,
 };
@@ -29,16 +42,34 @@ enum class AddressDistribution {
     ZIPFIAN,
 };
 
+enum class CompletionMode {
+    INTERRUPT,
+    POLL,
+    HYBRID,
+};
+
+enum class QueuePriority {
+    URGENT,
+    HIGH,
+    MEDIUM,
+    LOW,
+};
+
 struct FlowDefinition {
     std::string name;
     FlowType type;
     unsigned int nsid;
+    CompletionMode completion_mode;
+    bool irq_coalescing;
+    QueuePriority priority;
 
     union {
         struct {
             unsigned int seed;
             size_t request_count;
             double read_ratio;
+            /* Fraction of requests issued as deallocates. */
+            double trim_ratio;
 
             RequestSizeDistribution request_size_distribution;
             int request_size_mean;
@@ -57,7 +88,34 @@ struct HostConfig {
     unsigned int io_queue_depth;
     size_t sector_size;
 
+    unsigned int irq_coalescing_threshold;
+    unsigned int irq_coalescing_time;
+
+    bool wrr_arbitration;
+    unsigned int arbitration_burst;
+    unsigned int high_priority_weight;
+    unsigned int medium_priority_weight;
+    unsigned int low_priority_weight;
+
+    /* Command deadline in milliseconds, 0 to disable. */
+    unsigned int command_timeout;
+    /* Latency percentile after which reads are hedged, 0 to disable. */
+    double hedge_percentile;
+
+    /* SMART sampling interval in milliseconds, 0 to disable. */
+    unsigned int telemetry_interval;
+
+    /* Record per-queue command latency histograms. */
+    bool queue_latency_stats;
+
+    /* Create I/O queues when the first thread binds to them. */
+    bool lazy_queue_creation;
+
+    /* Place I/O submission queues in the controller memory buffer. */
+    bool cmb_submission_queues;
+
     std::unordered_map<unsigned int, NamespaceDefinition> namespaces;
+    std::vector<VolumeDefinition> volumes;
     std::vector<FlowDefinition> flows;
 };
 
@@ -5,6 +5,7 @@
 #include "histogram.h"
 #include "libunvme/memory_space.h"
 #include "libunvme/nvme_driver.h"
+#include "libunvme/striped_volume.h"
 
 #include <chrono>
 #include <memory>
@@ -20,6 +21,7 @@ public:
         size_t request_count;
         size_t read_request_count;
         size_t write_request_count;
+        size_t trim_request_count;
 
         double iops_total;
         double iops_read;
@@ -29,6 +31,13 @@ public:
         double bandwidth_read;
         double bandwidth_write;
 
+        /* Heap allocations made inside driver submission calls that take a
+         * batch context and inside those that take an AsyncCommandCallback
+         * (striped volumes and trims). */
+        size_t submit_heap_allocations;
+        size_t callback_submit_heap_allocations;
+        size_t callback_submissions;
+
         Histogram device_response_time_hist;
         Histogram e2e_latency_hist;
 
@@ -41,26 +50,44 @@ public:
 
     static std::unique_ptr<IOThread>
     create_thread(NVMeDriver* driver, MemorySpace* memory_space, int thread_id,
-                  unsigned int queue_depth, size_t sector_size, size_t max_lsa,
+                  size_t sector_size, size_t max_lsa,
                   const FlowDefinition& def);
 
     const Stats& get_stats() const { return stats; }
 
+    /* Issue requests to a striped volume instead of the driver. nsid of the
+     * requests is then ignored. Must be called before run(). */
+    void set_volume(StripedVolume* volume) { this->volume = volume; }
+
+    /* Batch completion callback for the driver. */
+    static void
+    complete_requests(const NVMeDriver::BatchCompletion* completions,
+                      size_t count);
+
     void run();
 
     void join();
 
 protected:
     IOThread(NVMeDriver* driver, MemorySpace* memory_space, int thread_id,
-             unsigned int queue_depth, size_t request_count);
+             size_t request_count);
 
     virtual void run_impl() = 0;
 
     void submit_io_request(bool do_write, unsigned int nsid, loff_t pos,
                            size_t size);
 
+    /* Deallocate the range; counted as a request without transfer. */
+    void submit_trim_request(unsigned int nsid, loff_t pos, size_t size);
+
     void wait_for_completed_requests();
 
+    /* Batch submissions to the driver or the volume. */
+    void plug();
+    void unplug();
+
+    bool supports_deallocate() const;
+
     virtual void on_request_completed() = 0;
 
     size_t request_count;
@@ -70,16 +97,26 @@ protected:
     size_t nr_completed_requests;
     size_t nr_completed_read_requests;
     size_t nr_completed_write_requests;
+    size_t nr_completed_trim_requests;
 
     size_t transferred_bytes_total;
     size_t transferred_bytes_read;
     size_t transferred_bytes_write;
 
+    size_t submit_heap_allocations;
+    size_t callback_submit_heap_allocations;
+    size_t nr_callback_submissions;
+
     Stats stats;
 
+    NVMeDriver* driver;
+    StripedVolume* volume;
+
 private:
     struct IORequest {
+        IOThread* thread;
         bool do_write;
+        bool do_trim;
         unsigned int nsid;
         loff_t pos;
         MemorySpace::Address buf;
@@ -87,14 +124,12 @@ private:
 
         std::chrono::time_point<std::chrono::system_clock> arrival_time;
         std::chrono::time_point<std::chrono::system_clock> enqueued_time;
+        std::chrono::time_point<std::chrono::system_clock> completion_time;
     };
 
-    NVMeDriver* driver;
     MemorySpace* memory_space;
     int thread_id;
-    unsigned int queue_depth;
-    unsigned int inflight_requests;
-    std::queue<IORequest*> waiting_requests;
+    bool polled;
 
     std::queue<IORequest*> completed_requests;
     std::mutex completion_mutex;
@@ -104,7 +139,7 @@ private:
 
     void submit_to_device(IORequest* req);
 
-    void notify_request_completion(IORequest* req);
+    void record_latency(IORequest* req);
 
     void process_completed_request(IORequest* req);
 };
@@ -9,9 +9,9 @@ class IOThreadSynthetic : public IOThread {
 public:
     IOThreadSynthetic(NVMeDriver* driver, MemorySpace* memory_space,
                       int thread_id, unsigned int nsid,
-                      unsigned int queue_depth, unsigned int sector_size,
-                      size_t max_lsa, unsigned int seed, size_t request_count,
-                      double read_ratio,
+                      unsigned int sector_size, size_t max_lsa,
+                      unsigned int seed, size_t request_count,
+                      double read_ratio, double trim_ratio,
                       RequestSizeDistribution request_size_distribution,
                       int request_size_mean, int request_size_variance,
                       AddressDistribution addr_distribution,
@@ -23,6 +23,7 @@ private:
     unsigned int sector_size;
     size_t max_lsa;
     double read_ratio;
+    double trim_ratio;
     std::default_random_engine generator;
 
     RequestSizeDistribution request_size_distribution;
@@ -35,7 +36,10 @@ private:
 
     unsigned int average_enqueued_requests;
 
-    void generate_request(bool& do_write, loff_t& pos, size_t& size);
+    void generate_request(bool& do_trim, bool& do_write, loff_t& pos,
+                          size_t& size);
+
+    void submit_request();
 
     virtual void run_impl();
 
@@ -4,11 +4,16 @@
 #include "sim_result.pb.h"
 
 #include "io_thread.h"
+#include "telemetry_sampler.h"
 
 #include <string>
 
 struct HostResult {
     std::vector<IOThread::Stats> thread_stats;
+    std::vector<NVMeDriver::IrqStats> irq_stats;
+    std::vector<NVMeDriver::QueueStats> queue_stats;
+    NVMeDriver::HedgeStats hedge_stats;
+    TelemetrySampler::Telemetry telemetry;
 };
 
 struct ResultExporter {
@@ -0,0 +1,91 @@
+#ifndef _TELEMETRY_SAMPLER_H_
+#define _TELEMETRY_SAMPLER_H_
+
+#include "libunvme/nvme_driver.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Device-side telemetry of a run: SMART counters sampled at a fixed
+ * interval and the asynchronous events reported by the controller, both
+ * timestamped relative to start(). Everything goes through the admin queue
+ * on a thread of its own, so I/O queues are never blocked. */
+class TelemetrySampler {
+public:
+    struct SmartSample {
+        double time;
+        unsigned int critical_warning;
+        /* Composite temperature in Kelvin. */
+        unsigned int temperature;
+        unsigned int percent_used;
+        /* Data units are thousands of 512-byte blocks. Counters are the low
+         * 64 bits of the 128-bit SMART fields. */
+        uint64_t data_units_read;
+        uint64_t data_units_written;
+        uint64_t host_reads;
+        uint64_t host_writes;
+        uint64_t media_errors;
+        uint64_t error_log_entries;
+    };
+
+    struct EventRecord {
+        double time;
+        NVMeDriver::AsyncEvent event;
+    };
+
+    struct ErrorRecord {
+        uint64_t error_count;
+        unsigned int sqid;
+        unsigned int cmdid;
+        unsigned int status;
+        uint64_t lba;
+        unsigned int nsid;
+    };
+
+    struct Telemetry {
+        unsigned int interval_ms;
+        std::vector<SmartSample> smart_samples;
+        std::vector<EventRecord> async_events;
+        std::vector<ErrorRecord> error_log;
+    };
+
+    /* Must be constructed before driver->start() to receive asynchronous
+     * events. An interval of 0 records events only. */
+    TelemetrySampler(NVMeDriver* driver, unsigned int interval_ms);
+    ~TelemetrySampler() { stop(); }
+
+    void start();
+
+    /* Stop sampling, take a last sample and read the error log entries
+     * added during the run. */
+    void stop();
+
+    Telemetry get_telemetry();
+
+private:
+    static const size_t MAX_ERROR_LOG_ENTRIES = 64;
+
+    NVMeDriver* driver;
+    unsigned int interval_ms;
+    bool sampling;
+    std::chrono::time_point<std::chrono::steady_clock> start_time;
+
+    std::mutex mutex;
+    std::condition_variable stop_cv;
+    bool stopping;
+    Telemetry telemetry;
+
+    std::thread thread;
+
+    double elapsed() const;
+
+    void on_async_event(const NVMeDriver::AsyncEvent& event);
+
+    bool take_sample();
+    void read_error_log();
+};
+
+#endif
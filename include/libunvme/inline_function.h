@@ -0,0 +1,125 @@
+#ifndef _INLINE_FUNCTION_H_
+#define _INLINE_FUNCTION_H_
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* Move-only callable wrapper with fixed inline storage. Unlike std::function
+ * it never allocates: callables that do not fit into Capacity bytes are
+ * rejected at compile time. */
+template <typename Signature, size_t Capacity = 64> class InlineFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity> {
+public:
+    InlineFunction() noexcept : ops(nullptr) {}
+    InlineFunction(std::nullptr_t) noexcept : ops(nullptr) {}
+
+    template <typename F,
+              typename = std::enable_if_t<
+                  !std::is_same<std::decay_t<F>, InlineFunction>::value &&
+                  std::is_invocable_r<R, std::decay_t<F>&, Args...>::value>>
+    InlineFunction(F&& f) : ops(nullptr)
+    {
+        using Fn = std::decay_t<F>;
+
+        static_assert(sizeof(Fn) <= Capacity,
+                      "Callable too large for InlineFunction storage");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                      "Callable over-aligned for InlineFunction storage");
+        static_assert(std::is_nothrow_move_constructible<Fn>::value,
+                      "Callable must be nothrow move constructible");
+
+        ::new (static_cast<void*>(storage)) Fn(std::forward<F>(f));
+        ops = &ops_for<Fn>;
+    }
+
+    InlineFunction(InlineFunction&& other) noexcept : ops(other.ops)
+    {
+        if (ops) {
+            ops->relocate(storage, other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+
+            if (other.ops) {
+                ops = other.ops;
+                ops->relocate(storage, other.storage);
+                other.ops = nullptr;
+            }
+        }
+
+        return *this;
+    }
+
+    InlineFunction& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+    R operator()(Args... args)
+    {
+        assert(ops);
+        return ops->invoke(storage, std::forward<Args>(args)...);
+    }
+
+private:
+    struct Ops {
+        R (*invoke)(void*, Args&&...);
+        /* Move-construct into dst and destroy src. */
+        void (*relocate)(void* dst, void* src) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    template <typename Fn>
+    static R invoke_fn(void* p, Args&&... args)
+    {
+        return (*static_cast<Fn*>(p))(std::forward<Args>(args)...);
+    }
+
+    template <typename Fn> static void relocate_fn(void* dst, void* src) noexcept
+    {
+        auto* f = static_cast<Fn*>(src);
+
+        ::new (dst) Fn(std::move(*f));
+        f->~Fn();
+    }
+
+    template <typename Fn> static void destroy_fn(void* p) noexcept
+    {
+        static_cast<Fn*>(p)->~Fn();
+    }
+
+    template <typename Fn>
+    static constexpr Ops ops_for = {&invoke_fn<Fn>, &relocate_fn<Fn>,
+                                    &destroy_fn<Fn>};
+
+    void reset() noexcept
+    {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[Capacity];
+    const Ops* ops;
+};
+
+#endif
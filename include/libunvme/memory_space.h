@@ -2,10 +2,15 @@
 #define _DEVICE_ADDRESS_SPACE_H_
 
 #include <array>
+#include <cstdint>
 #include <filesystem>
 #include <mutex>
 #include <string>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 class MemorySpace {
 public:
     using Address = uint32_t;
@@ -24,6 +29,11 @@ public:
     virtual void memset(Address addr, int c, size_t len);
 
     const void* get_raw_ptr(Address addr, size_t& len) const;
+    void* get_raw_ptr(Address addr, size_t& len)
+    {
+        return const_cast<void*>(
+            static_cast<const MemorySpace*>(this)->get_raw_ptr(addr, len));
+    }
 
     void* get_map_base() const { return map_base; }
     size_t get_map_size() const { return map_size; }
@@ -75,6 +85,25 @@ class BARMemorySpace : public MemorySpace {
 public:
     explicit BARMemorySpace(void* base, size_t size);
 
+    /* Copy a 64-byte command to a mapping of the BAR with as few stores as
+     * possible, each of which becomes a posted write to the device. */
+    static void write_command(void* dst, const void* src)
+    {
+#if defined(__x86_64__)
+        auto* d = static_cast<__m128i*>(dst);
+        auto* s = static_cast<const __m128i*>(src);
+
+        for (int i = 0; i < 4; i++)
+            _mm_store_si128(d + i, _mm_loadu_si128(s + i));
+#else
+        auto* d = static_cast<volatile uint64_t*>(dst);
+        auto* s = static_cast<const uint64_t*>(src);
+
+        for (int i = 0; i < 8; i++)
+            d[i] = s[i];
+#endif
+    }
+
     virtual void read(Address addr, void* buf, size_t len);
     virtual void write(Address addr, const void* buf, size_t len);
     virtual void memset(Address addr, int c, size_t len);
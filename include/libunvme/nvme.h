@@ -35,12 +35,30 @@ enum {
 };
 
 #define NVME_CAP_MQES(cap) ((cap)&0xffff)
+#define NVME_CAP_AMS(cap) (((cap) >> 17) & 0x3)
 #define NVME_CAP_TIMEOUT(cap) (((cap) >> 24) & 0xff)
 #define NVME_CAP_STRIDE(cap) (((cap) >> 32) & 0xf)
 #define NVME_CAP_NSSRC(cap) (((cap) >> 36) & 0x1)
 #define NVME_CAP_MPSMIN(cap) (((cap) >> 48) & 0xf)
 #define NVME_CAP_MPSMAX(cap) (((cap) >> 52) & 0xf)
 
+#define NVME_CMB_BIR(cmbloc) ((cmbloc)&0x7)
+#define NVME_CMB_OFST(cmbloc) (((cmbloc) >> 12) & 0xfffff)
+
+enum {
+    NVME_CMBSZ_SQS = 1 << 0,
+    NVME_CMBSZ_CQS = 1 << 1,
+    NVME_CMBSZ_LISTS = 1 << 2,
+    NVME_CMBSZ_RDS = 1 << 3,
+    NVME_CMBSZ_WDS = 1 << 4,
+
+    NVME_CMBSZ_SZ_SHIFT = 12,
+    NVME_CMBSZ_SZ_MASK = 0xfffff,
+
+    NVME_CMBSZ_SZU_SHIFT = 8,
+    NVME_CMBSZ_SZU_MASK = 0xf,
+};
+
 /*
  * Submission and Completion Queue Entry Sizes for the NVM command set.
  * (In bytes and specified as a power of two (2^n)).
@@ -64,6 +82,8 @@ enum {
     NVME_CC_AMS_RR = 0 << NVME_CC_AMS_SHIFT,
     NVME_CC_AMS_WRRU = 1 << NVME_CC_AMS_SHIFT,
     NVME_CC_AMS_VS = 7 << NVME_CC_AMS_SHIFT,
+    NVME_CAP_AMS_WRRU = 1 << 0,
+    NVME_CAP_AMS_VS = 1 << 1,
     NVME_CC_SHN_NONE = 0 << NVME_CC_SHN_SHIFT,
     NVME_CC_SHN_NORMAL = 1 << NVME_CC_SHN_SHIFT,
     NVME_CC_SHN_ABRUPT = 2 << NVME_CC_SHN_SHIFT,
@@ -261,11 +281,72 @@ enum {
     NVME_NS_DPS_PI_TYPE3 = 3,
 };
 
+enum {
+    NVME_CTRL_ONCS_COMPARE = 1 << 0,
+    NVME_CTRL_ONCS_WRITE_UNCORRECTABLE = 1 << 1,
+    NVME_CTRL_ONCS_DSM = 1 << 2,
+    NVME_CTRL_ONCS_WRITE_ZEROES = 1 << 3,
+};
+
+enum {
+    NVME_CTRL_SGLS_MASK = 0x3,
+    NVME_CTRL_SGLS_BYTE_ALIGNED = 0x1,
+    NVME_CTRL_SGLS_DWORD_ALIGNED = 0x2,
+    NVME_CTRL_SGLS_BIT_BUCKET = 1 << 16,
+};
+
+/*
+ * Descriptor subtype - 4 bits
+ */
+enum {
+    NVME_SGL_FMT_ADDRESS = 0x00,
+    NVME_SGL_FMT_OFFSET = 0x01,
+    NVME_SGL_FMT_TRANSPORT_A = 0x0A,
+    NVME_SGL_FMT_INVALIDATE = 0x0f,
+};
+
+/*
+ * SGL descriptor type - 4 bits
+ */
+enum {
+    NVME_SGL_FMT_DATA_DESC = 0x00,
+    NVME_SGL_FMT_BIT_BUCKET_DESC = 0x01,
+    NVME_SGL_FMT_SEG_DESC = 0x02,
+    NVME_SGL_FMT_LAST_SEG_DESC = 0x03,
+    NVME_KEY_SGL_FMT_DATA_DESC = 0x04,
+    NVME_TRANSPORT_SGL_DATA_DESC = 0x05,
+};
+
+struct nvme_sgl_desc {
+    __le64 addr;
+    __le32 length;
+    __u8 rsvd[3];
+    __u8 type;
+};
+
+struct nvme_keyed_sgl_desc {
+    __le64 addr;
+    __u8 length[3];
+    __u8 key[4];
+    __u8 type;
+};
+
 union nvme_data_ptr {
     struct {
         __le64 prp1;
         __le64 prp2;
     };
+    struct nvme_sgl_desc sgl;
+    struct nvme_keyed_sgl_desc ksgl;
+};
+
+enum {
+    NVME_CMD_FUSE_FIRST = (1 << 0),
+    NVME_CMD_FUSE_SECOND = (1 << 1),
+
+    NVME_CMD_SGL_METABUF = (1 << 6),
+    NVME_CMD_SGL_METASEG = (1 << 7),
+    NVME_CMD_SGL_ALL = NVME_CMD_SGL_METABUF | NVME_CMD_SGL_METASEG,
 };
 
 /* I/O commands */
@@ -333,6 +414,49 @@ struct nvme_storpu_invoke_command {
     __le64 rsvd15;
 };
 
+struct nvme_dsm_cmd {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2[2];
+    union nvme_data_ptr dptr;
+    __le32 nr;
+    __le32 attributes;
+    __u32 rsvd12[4];
+};
+
+enum {
+    NVME_DSMGMT_IDR = 1 << 0,
+    NVME_DSMGMT_IDW = 1 << 1,
+    NVME_DSMGMT_AD = 1 << 2,
+};
+
+#define NVME_DSM_MAX_RANGES 256
+
+struct nvme_dsm_range {
+    __le32 cattr;
+    __le32 nlb;
+    __le64 slba;
+};
+
+struct nvme_write_zeroes_cmd {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2;
+    __le64 metadata;
+    union nvme_data_ptr dptr;
+    __le64 slba;
+    __le16 length;
+    __le16 control;
+    __le32 dsmgmt;
+    __le32 reftag;
+    __le16 apptag;
+    __le16 appmask;
+};
+
 /* Admin commands */
 
 enum nvme_admin_opcode {
@@ -400,6 +524,14 @@ enum {
     NVME_FEAT_RESV_MASK = 0x82,
     NVME_FEAT_RESV_PERSIST = 0x83,
     NVME_FEAT_WRITE_PROTECT = 0x84,
+    NVME_ARB_BURST_SHIFT = 0,
+    NVME_ARB_BURST_NO_LIMIT = 7,
+    NVME_ARB_LPW_SHIFT = 8,
+    NVME_ARB_MPW_SHIFT = 16,
+    NVME_ARB_HPW_SHIFT = 24,
+    NVME_IRQ_COALESCE_THR_SHIFT = 0,
+    NVME_IRQ_COALESCE_TIME_SHIFT = 8,
+    NVME_IRQ_CONFIG_CD = (1 << 16),
     NVME_LOG_ERROR = 0x01,
     NVME_LOG_SMART = 0x02,
     NVME_LOG_FW_SLOT = 0x03,
@@ -447,6 +579,98 @@ struct nvme_features {
     __le32 dword15;
 };
 
+struct nvme_get_log_page_command {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2[2];
+    union nvme_data_ptr dptr;
+    __u8 lid;
+    __u8 lsp; /* upper 4 bits reserved */
+    __le16 numdl;
+    __le16 numdu;
+    __u16 rsvd11;
+    __le32 lpol;
+    __le32 lpou;
+    __u32 rsvd14[2];
+};
+
+#define NVME_NSID_ALL 0xffffffff
+
+struct nvme_smart_log {
+    __u8 critical_warning;
+    __u8 temperature[2];
+    __u8 avail_spare;
+    __u8 spare_thresh;
+    __u8 percent_used;
+    __u8 endu_grp_crit_warn_sumry;
+    __u8 rsvd7[25];
+    __u8 data_units_read[16];
+    __u8 data_units_written[16];
+    __u8 host_reads[16];
+    __u8 host_writes[16];
+    __u8 ctrl_busy_time[16];
+    __u8 power_cycles[16];
+    __u8 power_on_hours[16];
+    __u8 unsafe_shutdowns[16];
+    __u8 media_errors[16];
+    __u8 num_err_log_entries[16];
+    __le32 warning_temp_time;
+    __le32 critical_comp_time;
+    __le16 temp_sensor[8];
+    __le32 thm_temp1_trans_count;
+    __le32 thm_temp2_trans_count;
+    __le32 thm_temp1_total_time;
+    __le32 thm_temp2_total_time;
+    __u8 rsvd232[280];
+};
+
+enum {
+    NVME_SMART_CRIT_SPARE = 1 << 0,
+    NVME_SMART_CRIT_TEMPERATURE = 1 << 1,
+    NVME_SMART_CRIT_RELIABILITY = 1 << 2,
+    NVME_SMART_CRIT_MEDIA = 1 << 3,
+    NVME_SMART_CRIT_VOLATILE_MEMORY = 1 << 4,
+};
+
+struct nvme_error_log_entry {
+    __le64 error_count;
+    __le16 sqid;
+    __le16 cmdid;
+    __le16 status_field;
+    __le16 parm_error_location;
+    __le64 lba;
+    __le32 nsid;
+    __u8 vs;
+    __u8 trtype;
+    __u8 rsvd30[2];
+    __le64 cs;
+    __le16 trtype_spec_info;
+    __u8 rsvd42[22];
+};
+
+enum {
+    NVME_AER_ERROR = 0,
+    NVME_AER_SMART = 1,
+    NVME_AER_NOTICE = 2,
+    NVME_AER_CSS = 6,
+    NVME_AER_VS = 7,
+};
+
+enum {
+    NVME_AER_NOTICE_NS_CHANGED = 0x00,
+    NVME_AER_NOTICE_FW_ACT_STARTING = 0x01,
+    NVME_AER_NOTICE_ANA = 0x03,
+    NVME_AER_NOTICE_DISC_CHANGED = 0xf0,
+};
+
+enum {
+    NVME_AEN_CFG_SMART_MASK = 0xff,
+    NVME_AEN_CFG_NS_ATTR = 1 << 8,
+    NVME_AEN_CFG_FW_ACT = 1 << 9,
+};
+
 struct nvme_create_cq {
     __u8 opcode;
     __u8 flags;
@@ -485,16 +709,30 @@ struct nvme_delete_queue {
     __u32 rsvd11[5];
 };
 
+struct nvme_abort_cmd {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __u32 rsvd1[9];
+    __le16 sqid;
+    __u16 cid;
+    __u32 rsvd11[5];
+};
+
 struct nvme_command {
     union {
         struct nvme_common_command common;
         struct nvme_rw_command rw;
         struct nvme_identify identify;
         struct nvme_features features;
+        struct nvme_get_log_page_command get_log_page;
         struct nvme_create_cq create_cq;
         struct nvme_create_sq create_sq;
         struct nvme_delete_queue delete_queue;
+        struct nvme_abort_cmd abort;
         struct nvme_storpu_invoke_command storpu_invoke;
+        struct nvme_dsm_cmd dsm;
+        struct nvme_write_zeroes_cmd write_zeroes;
     };
 };
 
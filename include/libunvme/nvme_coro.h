@@ -0,0 +1,270 @@
+#ifndef _NVME_CORO_H_
+#define _NVME_CORO_H_
+
+#if !defined(__cpp_impl_coroutine)
+#error "nvme_coro.h requires C++20 coroutines"
+#endif
+
+#include "nvme_driver.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/* Coroutine front-end for the asynchronous driver API. An NVMeExecutor runs
+ * any number of NVMeTask coroutines on one thread: I/O is awaited with
+ *
+ *     co_await exec.read(nsid, pos, buf, size);
+ *
+ * and the awaiting coroutine is resumed directly from completion processing
+ * in poll_completions(). The executor thread must be bound to a POLL or
+ * HYBRID queue that no other thread reaps. Coroutines must not issue
+ * synchronous driver calls, which would wait on the queue being reaped. */
+
+template <typename T = void> class NVMeTask;
+
+struct NVMeTaskPromiseBase {
+    /* Resume the awaiting coroutine, if any, once the task has finished. */
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            auto cont = h.promise().continuation;
+            return cont ? cont : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T> struct NVMeTaskPromise : NVMeTaskPromiseBase {
+    std::optional<T> value;
+
+    NVMeTask<T> get_return_object();
+
+    template <typename U> void return_value(U&& v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result()
+    {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <> struct NVMeTaskPromise<void> : NVMeTaskPromiseBase {
+    NVMeTask<void> get_return_object();
+
+    void return_void() {}
+
+    void result()
+    {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+/* Lazily started coroutine. The body runs when the task is awaited or
+ * spawned on an executor. */
+template <typename T> class NVMeTask {
+public:
+    using promise_type = NVMeTaskPromise<T>;
+
+    NVMeTask(NVMeTask&& other) noexcept
+        : handle(std::exchange(other.handle, nullptr))
+    {}
+
+    NVMeTask(const NVMeTask&) = delete;
+    NVMeTask& operator=(const NVMeTask&) = delete;
+
+    ~NVMeTask()
+    {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+    {
+        handle.promise().continuation = cont;
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    friend promise_type;
+
+    explicit NVMeTask(std::coroutine_handle<promise_type> handle)
+        : handle(handle)
+    {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T> NVMeTask<T> NVMeTaskPromise<T>::get_return_object()
+{
+    return NVMeTask<T>(
+        std::coroutine_handle<NVMeTaskPromise<T>>::from_promise(*this));
+}
+
+inline NVMeTask<void> NVMeTaskPromise<void>::get_return_object()
+{
+    return NVMeTask<void>(
+        std::coroutine_handle<NVMeTaskPromise<void>>::from_promise(*this));
+}
+
+class NVMeExecutor {
+public:
+    /* Suspends the awaiting coroutine until the command submitted by Submit
+     * completes. Throws DeviceIOError on an error status. */
+    template <typename Submit> class IOAwaiter {
+    public:
+        IOAwaiter(Submit&& submit, const char* error_msg)
+            : submit(std::move(submit)), error_msg(error_msg), status(0)
+        {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+
+            /* The coroutine may finish and free this awaiter once resumed,
+             * so resume() must come last. */
+            submit([this](NVMeDriver::NVMeStatus status,
+                          const NVMeDriver::NVMeResult& result) {
+                this->status = status;
+                this->result = result;
+                handle.resume();
+            });
+        }
+
+        NVMeDriver::NVMeResult await_resume()
+        {
+            if ((status & 0x7ff) != NVME_SC_SUCCESS)
+                throw NVMeDriver::DeviceIOError(error_msg);
+
+            return result;
+        }
+
+    private:
+        Submit submit;
+        const char* error_msg;
+        std::coroutine_handle<> handle;
+        NVMeDriver::NVMeStatus status;
+        NVMeDriver::NVMeResult result;
+    };
+
+    explicit NVMeExecutor(NVMeDriver* driver) : driver(driver), nr_running(0)
+    {}
+
+    NVMeExecutor(const NVMeExecutor&) = delete;
+    NVMeExecutor& operator=(const NVMeExecutor&) = delete;
+
+    /* Start task on the calling thread. It runs until its first suspension
+     * and is then driven by run(). */
+    void spawn(NVMeTask<void>&& task)
+    {
+        nr_running++;
+        run_task(std::move(task));
+    }
+
+    /* Reap completions until every spawned task has finished. Rethrows the
+     * first exception a task exited with. */
+    void run()
+    {
+        while (nr_running)
+            driver->poll_completions();
+
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    }
+
+    size_t running_tasks() const { return nr_running; }
+
+    auto read(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
+              size_t size)
+    {
+        return make_awaiter(
+            [=, this](NVMeDriver::AsyncCommandCallback&& cb) {
+                driver->read_async(nsid, pos, buf, size, std::move(cb));
+            },
+            "Read command error");
+    }
+
+    auto write(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
+               size_t size)
+    {
+        return make_awaiter(
+            [=, this](NVMeDriver::AsyncCommandCallback&& cb) {
+                driver->write_async(nsid, pos, buf, size, std::move(cb));
+            },
+            "Write command error");
+    }
+
+    auto flush(unsigned int nsid)
+    {
+        return make_awaiter(
+            [=, this](NVMeDriver::AsyncCommandCallback&& cb) {
+                driver->flush_async(nsid, std::move(cb));
+            },
+            "Flush command error");
+    }
+
+    /* The function's return value is in result.u64. */
+    auto invoke_function(unsigned int cid, MemorySpace::Address entry,
+                         MemorySpace::Address arg)
+    {
+        return make_awaiter(
+            [=, this](NVMeDriver::AsyncCommandCallback&& cb) {
+                driver->invoke_function_async(cid, entry, arg, std::move(cb));
+            },
+            "Invoke command error");
+    }
+
+private:
+    /* Self-destroying wrapper that owns a spawned task. */
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    NVMeDriver* driver;
+    size_t nr_running;
+    std::exception_ptr error;
+
+    template <typename Submit>
+    static IOAwaiter<Submit> make_awaiter(Submit&& submit, const char* msg)
+    {
+        return IOAwaiter<Submit>(std::move(submit), msg);
+    }
+
+    Detached run_task(NVMeTask<void> task)
+    {
+        try {
+            co_await task;
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+
+        nr_running--;
+    }
+};
+
+#endif
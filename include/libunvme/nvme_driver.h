@@ -1,18 +1,26 @@
 #ifndef _NVME_DRIVER_H_
 #define _NVME_DRIVER_H_
 
+#include "inline_function.h"
 #include "memory_space.h"
 #include "nvme.h"
 #include "pcie_link.h"
 
+#include <atomic>
+#include <cassert>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 class NVMeDriver {
     friend class AsyncCommand;
 
+    struct NVMeQueue;
+
 public:
     struct DeviceIOError : public virtual std::runtime_error {
         DeviceIOError(const char* msg);
@@ -25,31 +33,155 @@ public:
     using NVMeStatus = uint32_t;
     using NVMeResult = nvme_completion::nvme_result;
 
+    /* Completion callbacks are stored inline in the command slot and must
+     * fit into 64 bytes of captures. */
     using AsyncCommandCallback =
-        std::function<void(NVMeStatus, const NVMeResult&)>;
+        InlineFunction<void(NVMeStatus, const NVMeResult&), 64>;
+
+    /* Completion of a command submitted with a batch context. */
+    struct BatchCompletion {
+        void* context;
+        NVMeStatus status;
+        NVMeResult result;
+    };
+
+    using BatchCompletionCallback =
+        std::function<void(const BatchCompletion*, size_t)>;
+
+    /* One DMA buffer of a vectored request. */
+    struct IOSegment {
+        MemorySpace::Address addr;
+        size_t len;
+    };
+
+    /* A block-aligned byte range of a namespace. */
+    struct LBARange {
+        loff_t pos;
+        size_t size;
+    };
+
+    /* How completions of an I/O queue are reaped. INTERRUPT queues are
+     * drained by the link's IRQ thread. POLL and HYBRID queues are reaped
+     * inline by the thread bound to them through poll_completions(); HYBRID
+     * first sleeps for about half of the observed service time. */
+    enum class CompletionMode {
+        INTERRUPT,
+        POLL,
+        HYBRID,
+    };
+
+    /* Submission queue priority classes under weighted round robin
+     * arbitration. URGENT queues are always served first. */
+    enum class QueuePriority {
+        URGENT,
+        HIGH,
+        MEDIUM,
+        LOW,
+    };
+
+    /* How bind_thread() picks an I/O queue for the calling thread. Any
+     * number of threads may share a queue. */
+    enum class QueueBinding {
+        ROUND_ROBIN,
+        CPU,
+    };
+
+    /* Interrupts raised for a queue and the completions they reaped. */
+    struct IrqStats {
+        unsigned int qid;
+        uint64_t irq_count;
+        uint64_t cqe_count;
+    };
+
+    /* Identify namespace data of the active LBA format. Sizes are in
+     * logical blocks of 1 << lba_shift bytes. */
+    struct NamespaceInfo {
+        uint64_t nsze;
+        uint64_t ncap;
+        unsigned int lba_shift;
+        unsigned int metadata_size;
+        bool extended_lba;
+    };
+
+    /* Asynchronous event reported by the controller. type is one of
+     * NVME_AER_*, info the event code within the type and log_page the log
+     * page that was read to re-arm the event (0 if none). */
+    struct AsyncEvent {
+        uint8_t type;
+        uint8_t info;
+        uint8_t log_page;
+    };
+
+    using AsyncEventCallback = std::function<void(const AsyncEvent&)>;
+
+    /* Commands of a queue whose submit-to-completion time fell below
+     * limit_ns, and above the limit of the previous bucket. */
+    struct LatencyBucket {
+        uint64_t limit_ns;
+        uint64_t count;
+    };
+
+    /* Counters of an I/O queue since start(). Occupancy is sampled on every
+     * submission; in_flight_sum / submitted is the mean queue depth seen by
+     * the device. sq_doorbells counts SQ tail updates, of which shadow
+     * doorbells may turn some into memory writes only. PRP list pages come
+     * from the per-queue pool or are allocated per command. */
+    struct QueueStats {
+        unsigned int qid;
+        /* Submission queue placed in the controller memory buffer. */
+        bool sq_in_cmb;
+        uint64_t submitted;
+        uint64_t completed;
+        uint64_t in_flight;
+        uint64_t max_in_flight;
+        uint64_t in_flight_sum;
+        uint64_t sq_doorbells;
+        uint64_t sq_mmio_writes;
+        uint64_t irq_count;
+        uint64_t irq_cqe_count;
+        uint64_t prp_list_pooled;
+        uint64_t prp_list_allocs;
+        /* Empty unless latency tracking is enabled. */
+        uint64_t latency_sum_ns;
+        std::vector<LatencyBucket> latency_hist;
+    };
+
+    /* Reads reissued on another queue, and those the reissue won. */
+    struct HedgeStats {
+        uint64_t issued;
+        uint64_t won;
+    };
 
     class AsyncCommand {
         friend class NVMeDriver;
 
     public:
-        ~AsyncCommand()
-        {
-            for (auto&& prp : prp_lists)
-                space->free(prp, 0x1000);
-        }
-
         NVMeStatus wait(NVMeResult* resp);
 
     private:
-        std::mutex mutex;
-        std::condition_variable cv;
+        enum : uint32_t {
+            CMD_PENDING = 0,
+            CMD_WAITING = 1,
+            CMD_COMPLETED = 2,
+        };
+
+        /* Futex word: the waiter parks on CMD_WAITING and the completion
+         * path only issues a wake-up if it observes a parked waiter. */
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> next_free;
+        /* Bumped whenever the slot is released, so that timers of earlier
+         * commands in the slot can be told apart. */
+        std::atomic<uint32_t> gen;
+
         NVMeDriver* driver;
-        MemorySpace* space;
+        NVMeQueue* nvmeq;
 
         uint16_t id;
+        uint8_t opcode;
+        void* context;
         NVMeStatus status;
         NVMeResult result;
-        bool completed;
+        uint64_t submit_time;
         AsyncCommandCallback callback;
         std::vector<MemorySpace::Address> prp_lists;
     };
@@ -57,10 +189,121 @@ public:
     explicit NVMeDriver(unsigned ncpus, unsigned int io_queue_depth,
                         PCIeLink* link, MemorySpace* memory_space,
                         bool use_dbbuf = false);
+    ~NVMeDriver();
 
     void start();
 
+    /* Must be called before start(). Larger reads and writes are split
+     * into several commands. The limit is lowered to the controller's MDTS
+     * on start(). */
+    void set_max_transfer_size(size_t size);
+    void set_completion_mode(unsigned int qid, CompletionMode mode);
+    /* Aggregate up to threshold completions (1-256) or wait at most
+     * time_100us hundreds of microseconds before raising an interrupt. Zero
+     * for both leaves coalescing off. Queues with coalescing disabled keep
+     * one interrupt per completion. */
+    void set_irq_coalescing(unsigned int threshold, unsigned int time_100us);
+    void set_irq_coalescing_disabled(unsigned int qid, bool disabled);
+    /* Enable weighted round robin with urgent priority class arbitration.
+     * Weights are the number of commands taken from a class per round
+     * (1-256); burst is the log2 arbitration burst or 7 for no limit. Falls
+     * back to round robin if the controller does not support it. */
+    void set_arbitration(unsigned int high_weight, unsigned int medium_weight,
+                         unsigned int low_weight,
+                         unsigned int burst = NVME_ARB_BURST_NO_LIMIT);
+    void set_queue_priority(unsigned int qid, QueuePriority prio);
+    /* Abort commands still outstanding timeout_ms after submission; 0 (the
+     * default) disables deadlines. Deadlines are kept in a timer wheel per
+     * queue and checked by a watchdog thread. Aborted commands complete
+     * with NVME_SC_ABORT_REQ. */
+    void set_command_timeout(unsigned int timeout_ms);
+    /* Hedge block-aligned asynchronous reads: a read still outstanding
+     * after the given percentile (e.g. 99.9) of the observed read latencies
+     * is reissued into a bounce buffer on another interrupt-driven queue.
+     * If the reissue succeeds first, the original command is aborted and
+     * the reissued data is delivered once the original has finished, so the
+     * buffer is never written after the callback ran. 0 disables hedging.
+     * Reads are then completed through callbacks only, also those submitted
+     * with read_batched(). */
+    void set_read_hedging(double percentile);
+    /* Record a submit-to-completion latency histogram per I/O queue, at the
+     * cost of two clock reads per command. Must be called before start(). */
+    void set_queue_latency_stats(bool enabled)
+    {
+        queue_latency_stats = enabled;
+    }
+    /* Create an I/O queue only when the first thread is bound to it rather
+     * than all of them on start(). Must be called before start(). */
+    void set_lazy_queue_creation(bool lazy) { lazy_queues = lazy; }
+    /* Place I/O submission queues in the controller memory buffer (BAR4)
+     * if the controller supports it, so that commands are written to the
+     * device instead of fetched from host memory. Queues fall back to host
+     * memory otherwise. Must be called before start(). */
+    void set_cmb_submission_queues(bool enabled) { use_cmb_sqs = enabled; }
+    CompletionMode get_completion_mode(unsigned int qid) const
+    {
+        return completion_modes[qid];
+    }
+
+    void set_queue_binding(QueueBinding binding) { queue_binding = binding; }
+
+    /* Bind the calling thread to I/O queue ((thread_id - 1) mod the number
+     * of I/O queues) + 1. */
     void set_thread_id(unsigned int thread_id);
+    /* Bind the calling thread to an I/O queue chosen by the queue binding
+     * policy and return its ID. CPU binding uses the CPU the thread runs on
+     * at the time of the call. */
+    unsigned int bind_thread();
+
+    /* I/O queue the calling thread is bound to, 0 if none. */
+    unsigned int get_thread_queue()
+    {
+        auto* nvmeq = thread_context().io_queue;
+        return nvmeq ? nvmeq->qid : 0;
+    }
+
+    MemorySpace* get_memory_space() const { return memory_space; }
+
+    size_t get_max_transfer_size() const { return max_transfer_size; }
+
+    /* Identify controller data, available after start(). */
+    const struct nvme_id_ctrl* get_id_ctrl() const { return id_ctrl.get(); }
+
+    /* True if the controller takes byte-aligned SGLs with bit buckets. Reads
+     * then need not be block aligned: only the requested bytes are
+     * transferred into the buffer, but the blocks covering them must fit in
+     * get_max_transfer_size(). Writes must still cover whole blocks. */
+    bool supports_unaligned_read() const
+    {
+        return (ctrl_sgls & NVME_CTRL_SGLS_MASK) ==
+                   NVME_CTRL_SGLS_BYTE_ALIGNED &&
+               (ctrl_sgls & NVME_CTRL_SGLS_BIT_BUCKET);
+    }
+
+    /* Reap the completion queue bound to the calling thread and run the
+     * callbacks of completed commands inline. Returns the number of
+     * completions found. If another thread is reaping the same queue, returns
+     * 0 immediately; callbacks of a shared queue may thus run on any thread
+     * bound to it. */
+    unsigned int poll_completions();
+
+    std::vector<IrqStats> get_irq_stats() const;
+
+    /* Snapshot of the I/O queue counters. Counters are read one by one
+     * while I/O may be running, so they need not add up exactly. */
+    std::vector<QueueStats> get_queue_stats() const;
+
+    HedgeStats get_hedge_stats() const
+    {
+        return {hedges_issued.load(std::memory_order_relaxed),
+                hedges_won.load(std::memory_order_relaxed)};
+    }
+
+    /* Defer SQ doorbell writes of the calling thread's queue until the
+     * matching unplug() so that a burst of submissions rings the doorbell
+     * once. Plugs nest; synchronous waits flush pending entries. */
+    void plug() { thread_context().plug_depth++; }
+    void unplug();
 
     void read(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
               size_t size);
@@ -70,6 +313,47 @@ public:
 
     void flush(unsigned int nsid);
 
+    /* Completions of commands submitted with read_batched()/write_batched()
+     * are handed to cb once per batch reaped from a queue, after the CQ
+     * doorbell is rung and the slots are released. Must be called before
+     * start(). */
+    void set_batch_completion_callback(BatchCompletionCallback&& cb)
+    {
+        batch_callback = std::move(cb);
+    }
+
+    /* Asynchronous event requests are kept outstanding on the admin queue
+     * from start() on. cb runs on the admin queue's interrupt thread for
+     * every event and must not issue synchronous commands. Must be called
+     * before start(). */
+    void set_async_event_callback(AsyncEventCallback&& cb)
+    {
+        async_event_callback = std::move(cb);
+    }
+
+    /* Read size bytes at offset of log page lid into buf. Issued on the
+     * admin queue only; I/O queues are never blocked. */
+    NVMeStatus get_log_page(unsigned int nsid, uint8_t lid,
+                            MemorySpace::Address buf, size_t size,
+                            uint64_t offset = 0);
+
+    /* Controller-wide SMART / health information. Throws DeviceIOError if
+     * the log page cannot be read. */
+    void get_smart_log(struct nvme_smart_log* log);
+
+    /* Read up to max entries of the error information log, most recent
+     * first. Returns the number of entries read. */
+    size_t get_error_log(struct nvme_error_log_entry* entries, size_t max);
+
+    /* Asynchronous commands submitted while a queue is full are held in a
+     * per-queue overflow queue of at most limit entries (the I/O queue depth
+     * by default) and issued in order as completions free up room. Once it
+     * is full, read_async()/write_async() wait for completions on the queue
+     * and try_read_async()/try_write_async() return false. Commands
+     * submitted from completion callbacks cannot wait and may exceed the
+     * limit. Takes effect for queues allocated after the call. */
+    void set_overflow_limit(size_t limit) { overflow_limit = limit; }
+
     void read_async(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
                     size_t size, AsyncCommandCallback&& callback)
     {
@@ -84,6 +368,97 @@ public:
                                 std::move(callback));
     }
 
+    /* Like read_async()/write_async() but return false instead of queueing
+     * the command if the queue has no room. The callback is not invoked in
+     * that case. Requests above the maximum transfer size are split and
+     * always accepted. */
+    bool try_read_async(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
+                        size_t size, AsyncCommandCallback&& callback)
+    {
+        if (size > max_transfer_size) {
+            read_async(nsid, pos, buf, size, std::move(callback));
+            return true;
+        }
+
+        return submit_rw_command(false, nsid, pos, buf, size,
+                                 std::move(callback), nullptr,
+                                 true) != nullptr;
+    }
+
+    bool try_write_async(unsigned int nsid, loff_t pos,
+                         MemorySpace::Address buf, size_t size,
+                         AsyncCommandCallback&& callback)
+    {
+        if (size > max_transfer_size) {
+            write_async(nsid, pos, buf, size, std::move(callback));
+            return true;
+        }
+
+        return submit_rw_command(true, nsid, pos, buf, size,
+                                 std::move(callback), nullptr,
+                                 true) != nullptr;
+    }
+
+    /* context must not be null. */
+    void read_batched(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
+                      size_t size, void* context)
+    {
+        assert(context);
+        (void)submit_rw_command(false, nsid, pos, buf, size, {}, context);
+    }
+
+    void write_batched(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
+                       size_t size, void* context)
+    {
+        assert(context);
+        (void)submit_rw_command(true, nsid, pos, buf, size, {}, context);
+    }
+
+    /* Vectored I/O: the iovcnt segments of iov are transferred in order
+     * starting at pos, which must be block aligned like the total length.
+     * With SGL support the segments are gathered into as few commands as
+     * the maximum transfer size allows. Otherwise runs of segments that
+     * meet on controller page boundaries share PRP lists, and each run
+     * must be a whole number of blocks. callback
+     * runs once after all commands complete, with the first error status. */
+    void readv_async(unsigned int nsid, loff_t pos, const IOSegment* iov,
+                     size_t iovcnt, AsyncCommandCallback&& callback)
+    {
+        submit_rwv_command(false, nsid, pos, iov, iovcnt, std::move(callback));
+    }
+
+    void writev_async(unsigned int nsid, loff_t pos, const IOSegment* iov,
+                      size_t iovcnt, AsyncCommandCallback&& callback)
+    {
+        submit_rwv_command(true, nsid, pos, iov, iovcnt, std::move(callback));
+    }
+
+    bool supports_deallocate() const
+    {
+        return ctrl_oncs & NVME_CTRL_ONCS_DSM;
+    }
+
+    bool supports_write_zeroes() const
+    {
+        return ctrl_oncs & NVME_CTRL_ONCS_WRITE_ZEROES;
+    }
+
+    /* Deallocate (trim) the nranges ranges. Up to NVME_DSM_MAX_RANGES
+     * ranges go into one Dataset Management command; callback runs once
+     * after all of them complete. */
+    void deallocate_async(unsigned int nsid, const LBARange* ranges,
+                          size_t nranges, AsyncCommandCallback&& callback)
+    {
+        submit_dsm_command(nsid, ranges, nranges, std::move(callback));
+    }
+
+    /* Zero size bytes at pos without transferring data. */
+    void write_zeroes_async(unsigned int nsid, loff_t pos, size_t size,
+                            AsyncCommandCallback&& callback)
+    {
+        submit_write_zeroes_command(nsid, pos, size, std::move(callback));
+    }
+
     void flush_async(unsigned int nsid, AsyncCommandCallback&& callback)
     {
         (void)submit_flush_command(nsid, std::move(callback));
@@ -100,30 +475,221 @@ public:
     unsigned long invoke_function(unsigned int cid, MemorySpace::Address entry,
                                   MemorySpace::Address arg);
 
+    /* The function's return value is in result.u64. */
+    void invoke_function_async(unsigned int cid, MemorySpace::Address entry,
+                               MemorySpace::Address arg,
+                               AsyncCommandCallback&& callback)
+    {
+        (void)submit_invoke_command(cid, entry, arg, std::move(callback));
+    }
+
     unsigned int create_namespace(size_t size_bytes);
     void delete_namespace(unsigned int nsid);
     void attach_namespace(unsigned int nsid);
     void detach_namespace(unsigned int nsid);
 
+    /* Namespaces are identified on attach or on first use, which issues a
+     * synchronous admin command: call this for every namespace before
+     * submitting I/O from completion callbacks. Namespace Attribute Changed
+     * events refresh known namespaces asynchronously. Throws
+     * NamespaceUnavailableError for inactive namespaces. */
+    NamespaceInfo get_namespace_info(unsigned int nsid)
+    {
+        return get_namespace(nsid);
+    }
+
 private:
     static constexpr unsigned AQ_DEPTH = 32;
+    static constexpr size_t DEFAULT_MAX_TRANSFER_SIZE = 2UL << 20;
+    static constexpr size_t MAX_RW_BLOCKS = 1UL << 16;
+    static constexpr unsigned int MIN_LBA_SHIFT = 9;
+    static constexpr unsigned int MAX_NAMESPACES = 1024;
+    static constexpr unsigned int MAX_ASYNC_EVENTS = 4;
+    static constexpr size_t ASYNC_EVENT_LOG_SIZE = 0x1000;
+    static constexpr size_t TIMER_WHEEL_SLOTS = 256;
+    /* Admin commands kept in flight during bring-up. */
+    static constexpr unsigned int ADMIN_PIPELINE_DEPTH = NVME_AQ_DEPTH / 2;
+    /* Controller status polling backoff. */
+    static constexpr unsigned int CSTS_SPIN_COUNT = 16;
+    static constexpr uint64_t CSTS_MIN_DELAY_US = 10;
+    static constexpr uint64_t CSTS_MAX_DELAY_US = 1000;
+    /* Timer granularity with hedging, and the coarsest one for deadlines. */
+    static constexpr uint64_t HEDGE_TICK_NS = 100000;
+    static constexpr uint64_t TIMEOUT_TICK_NS = 10000000;
+    static constexpr uint64_t HEDGE_MIN_SAMPLES = 1000;
+    static constexpr unsigned int HEDGE_UPDATE_TICKS = 100;
+    static constexpr unsigned int LATENCY_BUCKETS = 496;
+    static constexpr unsigned int MAX_DRIVERS = 16;
+
+    struct PendingCommand {
+        struct nvme_command cmd;
+        MemorySpace::Address buf;
+        size_t buflen;
+        std::vector<struct nvme_sgl_desc> sgl;
+        AsyncCommandCallback callback;
+        void* context;
+    };
+
+    /* Aggregated completion of a request fanned out into several commands.
+     * pending holds one extra reference while commands are submitted. buf,
+     * if buflen is set, is freed on completion. */
+    struct VectoredRequest {
+        std::atomic<unsigned int> pending;
+        std::atomic<NVMeStatus> status;
+        AsyncCommandCallback callback;
+        MemorySpace::Address buf;
+        size_t buflen;
+
+        explicit VectoredRequest(AsyncCommandCallback&& callback)
+            : pending(1), status(NVME_SC_SUCCESS),
+              callback(std::move(callback)), buf(0), buflen(0)
+        {}
+    };
+
+    /* Command deadline, or hedge timer if hedge is set. Deadlines of
+     * released slots are dropped lazily on expiry by comparing gen. Entries
+     * are preallocated, one deadline per command slot and one timer per
+     * hedged read, and linked into the wheel while armed. */
+    struct HedgedRead;
+    struct TimerEntry {
+        uint64_t expires;
+        HedgedRead* hedge;
+        uint32_t gen;
+        uint16_t cid;
+        bool aborted;
+        TimerEntry* prev;
+        TimerEntry* next;
+    };
+
+    /* A read that may be reissued on another queue. refs counts the
+     * original command, its hedge timer and the reissued command. */
+    struct HedgedRead {
+        std::mutex mutex;
+        std::atomic<unsigned int> refs;
+        bool primary_done;
+        bool hedge_issued;
+        bool hedge_done;
+        bool delivered;
+        NVMeStatus primary_status;
+        NVMeStatus hedge_status;
+        NVMeResult result;
+        AsyncCommandCallback callback;
+        void* context;
+        NVMeQueue* nvmeq;
+        /* Slot of the original command and its generation, to abort it. */
+        uint16_t cid;
+        uint32_t gen;
+        unsigned int nsid;
+        unsigned int lba_shift;
+        loff_t pos;
+        MemorySpace::Address buf;
+        MemorySpace::Address bounce;
+        size_t size;
+        TimerEntry timer;
+    };
+
+    /* info is null until the namespace is first identified, and
+     * INACTIVE_NAMESPACE while it is inactive. Snapshots are replaced, not
+     * modified, and kept until the driver goes away, so that readers need
+     * no lock. */
+    struct NamespaceSlot {
+        std::atomic<const NamespaceInfo*> info;
+    };
+
+    static const NamespaceInfo INACTIVE_NAMESPACE;
+
+    struct ReapedCommand {
+        AsyncCommandCallback callback;
+        void* context;
+        NVMeStatus status;
+        NVMeResult result;
+    };
 
     struct NVMeQueue {
+        /* Serializes submitters on sq_tail and the SQ doorbell. */
         std::mutex mutex;
+        /* Held by the thread reaping a polled completion queue. */
+        std::atomic<bool> cq_busy;
+
+        /* Command slots indexed by command ID. Free slots form a lock-free
+         * stack whose head packs an ABA tag in the upper 32 bits and the
+         * slot index (or depth if empty) in the lower 32 bits. */
+        std::unique_ptr<AsyncCommand[]> commands;
+        std::atomic<uint64_t> free_commands;
+
+        /* prp_pages_per_cmd PRP list pages reserved for each command slot. */
+        MemorySpace::Address prp_pool;
+        uint8_t* prp_pool_ptr;
 
         MemorySpace::Address sq_dma_addr;
         MemorySpace::Address cq_dma_addr;
-        MemorySpace::Address dbbuf_sq_db;
-        MemorySpace::Address dbbuf_cq_db;
+        /* Host mappings of the rings used on the hot paths. */
+        struct nvme_command* sq_cmds;
+        /* sq_dma_addr is an offset into BAR4 rather than host memory. */
+        bool sq_in_cmb;
+        struct nvme_completion* cqes;
+        /* Shadow doorbells and EventIdx entries, if enabled. */
+        uint32_t* dbbuf_sq_db;
+        uint32_t* dbbuf_cq_db;
+        uint32_t* dbbuf_sq_ei;
+        uint32_t* dbbuf_cq_ei;
         unsigned int depth;
+        CompletionMode mode;
+        QueuePriority priority;
+        bool coalescing_disabled;
+        std::atomic<bool> hybrid_armed;
+        std::atomic<uint64_t> mean_service_ns;
         unsigned char sqe_shift;
         uint16_t qid;
         uint16_t sq_tail;
+        /* Last SQ head reported by the controller. */
+        std::atomic<uint16_t> sq_head;
         uint16_t last_sq_tail;
         uint16_t cq_head;
         uint8_t cq_phase;
         uint32_t q_db;
 
+        /* Asynchronous commands that found the queue full, issued in order
+         * as completions free up room. Ring of overflow_limit entries whose
+         * SGL vectors are reused, grown only by submissions from callbacks. */
+        std::mutex overflow_mutex;
+        std::vector<PendingCommand> overflow;
+        size_t overflow_head;
+        std::atomic<size_t> overflow_count;
+
+        /* Completions of the batch being reaped. */
+        std::vector<ReapedCommand> reaped;
+        std::unique_ptr<BatchCompletion[]> batched;
+
+        std::atomic<uint64_t> irq_count;
+        std::atomic<uint64_t> irq_cqe_count;
+
+        /* Created on the controller and ready for submissions. */
+        std::atomic<bool> online;
+
+        /* Written under the SQ lock. */
+        std::atomic<uint64_t> submitted;
+        std::atomic<uint64_t> in_flight_sum;
+        std::atomic<uint64_t> max_in_flight;
+        std::atomic<uint64_t> sq_doorbells;
+        std::atomic<uint64_t> sq_mmio_writes;
+        /* Written by submitters concurrently. */
+        std::atomic<uint64_t> prp_list_pooled;
+        std::atomic<uint64_t> prp_list_allocs;
+        /* Written by the thread reaping the queue. */
+        std::atomic<uint64_t> completed;
+        std::atomic<uint64_t> latency_sum_ns;
+        std::unique_ptr<std::atomic<uint64_t>[]> latency_hist;
+
+        /* Timer wheel: entries bucketed by expiry tick modulo
+         * TIMER_WHEEL_SLOTS, each bucket a circular list around its head.
+         * timer_tick is the next tick to expire. deadlines holds the
+         * deadline of each command slot. */
+        std::mutex timer_mutex;
+        std::unique_ptr<TimerEntry[]> timers;
+        std::unique_ptr<TimerEntry[]> deadlines;
+        uint64_t timer_tick;
+
         inline void update_cq_head()
         {
             uint16_t tmp = cq_head + 1;
@@ -137,6 +703,17 @@ private:
         }
     };
 
+    /* Queue binding and plug depth of a thread for one driver instance.
+     * Contexts are indexed by the driver's slot; instance tells whether a
+     * context was set up for this driver or an earlier one in the slot. */
+    struct ThreadContext {
+        uint64_t instance;
+        NVMeQueue* io_queue;
+        unsigned int plug_depth;
+        /* Nesting of completion callbacks, which must not wait for room. */
+        unsigned int callback_depth;
+    };
+
     struct NVMeCompletion {
         /*
          * Used by Admin and Fabrics commands to return data:
@@ -157,20 +734,75 @@ private:
     MemorySpace* memory_space;
     std::vector<std::unique_ptr<NVMeQueue>> queues;
     size_t queue_count, online_queues;
-    std::mutex command_mutex;
-    std::atomic<uint16_t> command_id_counter;
-    std::unordered_map<uint16_t, std::unique_ptr<AsyncCommand>> command_map;
-    static thread_local struct NVMeQueue* thread_io_queue;
+    QueueBinding queue_binding;
+    std::atomic<unsigned int> next_bind_queue;
+    std::vector<CompletionMode> completion_modes;
+    BatchCompletionCallback batch_callback;
+    AsyncEventCallback async_event_callback;
+    /* One log page buffer per outstanding asynchronous event request. */
+    MemorySpace::Address async_event_bufs;
+    unsigned int nr_async_events;
+    std::vector<bool> coalescing_disabled;
+    std::vector<QueuePriority> queue_priorities;
+    bool use_wrr;
+    bool lazy_queues;
+    /* Serializes lazy creation of I/O queues. */
+    std::mutex queue_create_mutex;
+    uint32_t arbitration;
+    unsigned int irq_coalesce_threshold;
+    unsigned int irq_coalesce_time;
+    size_t max_transfer_size;
+    size_t prp_pages_per_cmd;
+    size_t overflow_limit;
+    uint64_t command_timeout_ns;
+    double hedge_percentile;
+    uint64_t timer_tick_ns;
+    std::atomic<uint64_t> hedge_delay_ns;
+    std::unique_ptr<std::atomic<uint64_t>[]> read_latency_hist;
+    bool queue_latency_stats;
+    std::atomic<uint64_t> hedges_issued;
+    std::atomic<uint64_t> hedges_won;
+    std::atomic<bool> watchdog_stop;
+    std::thread watchdog;
+    /* Scratch list of the watchdog thread. */
+    std::vector<TimerEntry> expired_timers;
+    static thread_local ThreadContext thread_contexts[MAX_DRIVERS];
+    static std::atomic<uint32_t> used_driver_slots;
+    static std::atomic<uint64_t> next_instance;
+    unsigned int driver_slot;
+    uint64_t instance;
 
     uint64_t ctrl_cap;
     uint32_t ctrl_config;
     uint32_t ctrl_page_size;
+    uint32_t ctrl_sgls;
+    uint16_t ctrl_oncs;
+    std::unique_ptr<struct nvme_id_ctrl> id_ctrl;
+    std::unique_ptr<NamespaceSlot[]> namespaces;
+    unsigned int nr_namespaces;
+    /* Serializes namespace updates and owns the snapshots. */
+    std::mutex ns_mutex;
+    std::vector<std::unique_ptr<NamespaceInfo>> namespace_infos;
     int queue_depth;
     int io_queue_depth;
     int db_stride;
     MemorySpace::Address dbbuf_dbs;
+    MemorySpace::Address dbbuf_eis;
 
     std::unique_ptr<MemorySpace> bar4_mem;
+    bool use_cmb_sqs;
+    /* Bus address of BAR4 and the CMB range within it, if SQs are placed
+     * there. */
+    uint64_t cmb_bar_addr;
+    size_t cmb_start, cmb_end;
+
+    ThreadContext& thread_context()
+    {
+        auto& ctx = thread_contexts[driver_slot];
+
+        if (ctx.instance != instance) ctx = {instance, nullptr, 0, 0};
+        return ctx;
+    }
 
     void reset();
 
@@ -183,26 +815,74 @@ private:
     void enable_controller();
     void wait_ready(bool enabled);
 
-    AsyncCommand* setup_async_command(AsyncCommandCallback&& callback);
-    void remove_async_command(uint16_t command_id);
+    AsyncCommand* alloc_async_command(NVMeQueue* nvmeq);
+    void remove_async_command(AsyncCommand* cmd);
 
+    void* get_list_page(AsyncCommand* acmd, size_t idx, bool pooled,
+                        MemorySpace::Address& addr);
+    bool sgl_usable(NVMeQueue* nvmeq, MemorySpace::Address buf,
+                    size_t buflen) const;
+    bool sgl_usable(NVMeQueue* nvmeq, const struct nvme_sgl_desc* descs,
+                    size_t ndescs) const;
+    bool prp_mergeable(const IOSegment& prev, const IOSegment& next) const
+    {
+        return !((prev.addr + prev.len) % ctrl_page_size) &&
+               !(next.addr % ctrl_page_size);
+    }
     void setup_buffer(AsyncCommand* acmd, struct nvme_command* cmd,
                       MemorySpace::Address buf, size_t buflen);
+    /* Describes data blocks with PRPs. Only the first block may start and
+     * only the last may end inside a controller page. */
+    void setup_prps(AsyncCommand* acmd, struct nvme_command* cmd,
+                    const struct nvme_sgl_desc* descs, size_t ndescs);
+    void setup_sgl(AsyncCommand* acmd, struct nvme_command* cmd,
+                   const struct nvme_sgl_desc* descs, size_t ndescs);
 
     void write_sq_doorbell(NVMeQueue* nvmeq, bool write_sq);
+    void flush_sq(NVMeQueue* nvmeq);
     void ring_cq_doorbell(NVMeQueue* nvmeq);
 
-    void submit_sq_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+    bool submit_sq_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
                            bool write_sq);
+    AsyncCommand* try_submit_command(NVMeQueue* nvmeq,
+                                     struct nvme_command* cmd,
+                                     MemorySpace::Address buf, size_t buflen,
+                                     const struct nvme_sgl_desc* descs,
+                                     size_t ndescs,
+                                     AsyncCommandCallback& callback,
+                                     void* context, bool write_sq,
+                                     HedgedRead* hedge = nullptr);
+    /* Returns nullptr if the command went to the overflow queue, or if
+     * nowait is set and the queue is full. Synchronous commands (without a
+     * callback) wait for room in the SQ, asynchronous ones for room in the
+     * overflow queue unless submitted from a callback. A hedge timer for
+     * hedge is armed if the command goes straight to the SQ. */
+    AsyncCommand* submit_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                                 MemorySpace::Address buf, size_t buflen,
+                                 const struct nvme_sgl_desc* descs,
+                                 size_t ndescs, AsyncCommandCallback&& callback,
+                                 void* context = nullptr, bool nowait = false,
+                                 HedgedRead* hedge = nullptr);
+    void drain_overflow(NVMeQueue* nvmeq);
+    void drain_overflow_locked(NVMeQueue* nvmeq);
+    void push_overflow_locked(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                              MemorySpace::Address buf, size_t buflen,
+                              const struct nvme_sgl_desc* descs, size_t ndescs,
+                              AsyncCommandCallback&& callback, void* context);
     NVMeStatus submit_sync_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
                                    MemorySpace::Address buf, size_t buflen,
                                    union nvme_completion::nvme_result* result);
     AsyncCommand* submit_async_command(NVMeQueue* nvmeq,
                                        struct nvme_command* cmd,
                                        MemorySpace::Address buf, size_t buflen,
-                                       AsyncCommandCallback&& callback);
+                                       AsyncCommandCallback&& callback)
+    {
+        return submit_command(nvmeq, cmd, buf, buflen, nullptr, 0,
+                              std::move(callback));
+    }
 
     void dbbuf_config();
+    uint32_t* dbbuf_ptr(MemorySpace::Address addr);
 
     NVMeDriver::NVMeStatus nvme_features(uint8_t op, unsigned int fid,
                                          unsigned int dword11,
@@ -214,27 +894,146 @@ private:
     }
 
     NVMeDriver::NVMeStatus set_queue_count(int& count);
+    void config_irq_coalescing();
+    void config_arbitration();
+    void config_async_events();
+
+    void submit_async_event(unsigned int slot);
+    void handle_async_event(unsigned int slot, NVMeStatus status,
+                            const NVMeResult& result);
+    void complete_async_event(unsigned int slot, const AsyncEvent& event,
+                              NVMeStatus status);
 
     void setup_admin_queue();
+    void setup_cmb();
+    bool allocate_cmb_sq(NVMeQueue* nvmeq, unsigned qid);
     void setup_io_queues();
 
+    /* Number of I/O queues threads are spread over. */
+    size_t nr_bindable_queues() const
+    {
+        return lazy_queues ? queue_count - 1 : online_queues - 1;
+    }
+
+    /* I/O queue qid, created first if queues are created lazily. */
+    NVMeQueue* get_io_queue(unsigned int qid);
+
+    /* Issue the admin commands with up to ADMIN_PIPELINE_DEPTH of them in
+     * flight and return their statuses in order. */
+    std::vector<NVMeStatus>
+    submit_admin_commands(std::vector<struct nvme_command>& cmds);
+
+    void create_io_queues(unsigned int first, unsigned int last);
     NVMeStatus create_queue(NVMeQueue* nvmeq, unsigned qid);
     NVMeStatus create_cq(NVMeQueue* nvmeq, unsigned qid, unsigned int vector);
     NVMeStatus create_sq(NVMeQueue* nvmeq, unsigned qid);
+    void init_create_cq(struct nvme_command* c, NVMeQueue* nvmeq,
+                        unsigned qid, unsigned int vector);
+    void init_create_sq(struct nvme_command* c, NVMeQueue* nvmeq,
+                        unsigned qid);
+    void init_disable_coalescing(struct nvme_command* c, unsigned qid);
+    bool needs_coalescing_disabled(NVMeQueue* nvmeq) const
+    {
+        return (irq_coalesce_threshold || irq_coalesce_time) &&
+               nvmeq->mode == CompletionMode::INTERRUPT &&
+               nvmeq->coalescing_disabled;
+    }
 
     NVMeStatus identify_controller();
+    void init_identify_namespace(struct nvme_command* c, unsigned int nsid);
+    /* Identify nsid and wait for the result. */
+    void identify_namespace(unsigned int nsid);
+    /* Re-identify a known namespace without waiting. */
+    void refresh_namespace(unsigned int nsid);
+    /* Update the cache from an Identify Namespace result in id_buf. */
+    void update_namespace(unsigned int nsid, NVMeStatus status,
+                          MemorySpace::Address id_buf);
+    void set_namespace(unsigned int nsid, const NamespaceInfo* info);
+    void invalidate_namespace(unsigned int nsid)
+    {
+        set_namespace(nsid, &INACTIVE_NAMESPACE);
+    }
+
+    const NamespaceInfo& get_namespace(unsigned int nsid)
+    {
+        if (nsid && nsid <= nr_namespaces) {
+            auto* info =
+                namespaces[nsid - 1].info.load(std::memory_order_acquire);
+
+            if (info == &INACTIVE_NAMESPACE) throw NamespaceUnavailableError();
+            if (info) return *info;
+        }
+
+        /* First use. */
+        identify_namespace(nsid);
+        return *namespaces[nsid - 1].info.load(std::memory_order_acquire);
+    }
+
+    void start_watchdog();
+    void stop_watchdog();
+    void run_watchdog();
+    /* Link timer into the wheel with the identity of entry, moving it if it
+     * is armed already, unless it is armed for a newer command. */
+    void arm_timer(NVMeQueue* nvmeq, TimerEntry* timer,
+                   const TimerEntry& entry, uint64_t delay_ns);
+    static void unlink_timer(TimerEntry* timer);
+    void drain_timers(NVMeQueue* nvmeq);
+    void expire_timers(NVMeQueue* nvmeq, uint64_t tick);
+    void handle_timeout(NVMeQueue* nvmeq, TimerEntry entry);
+    /* Abort the command in slot cid unless the slot has moved on from
+     * generation gen. */
+    void abort_command(NVMeQueue* nvmeq, uint16_t cid, uint32_t gen);
+
+    void record_read_latency(uint64_t ns);
+    void update_hedge_delay();
+    NVMeQueue* get_hedge_queue(NVMeQueue* nvmeq);
+    AsyncCommand* submit_hedged_read(struct nvme_command* cmd,
+                                     unsigned int nsid, unsigned int lba_shift,
+                                     loff_t pos, MemorySpace::Address buf,
+                                     size_t size,
+                                     AsyncCommandCallback&& callback,
+                                     void* context, bool nowait);
+    void issue_hedge(HedgedRead* hr);
+    void complete_hedged_read(HedgedRead* hr, bool hedge, NVMeStatus status,
+                              const NVMeResult& result);
+    void put_hedged_read(HedgedRead* hr);
 
     bool cqe_pending(NVMeQueue* nvmeq);
     void handle_cqe(NVMeQueue* nvmeq, uint16_t idx);
-    void nvme_irq(NVMeQueue* nvmeq);
+    unsigned int nvme_irq(NVMeQueue* nvmeq);
+    unsigned int poll_queue(NVMeQueue* nvmeq);
 
     AsyncCommand* submit_rw_command(bool do_write, unsigned int nsid,
                                     loff_t pos, MemorySpace::Address buf,
                                     size_t size,
-                                    AsyncCommandCallback&& callback);
+                                    AsyncCommandCallback&& callback,
+                                    void* context = nullptr,
+                                    bool nowait = false);
 
     AsyncCommand* submit_flush_command(unsigned int nsid,
                                        AsyncCommandCallback&& callback);
+    NVMeStatus submit_rw_sync(bool do_write, unsigned int nsid, loff_t pos,
+                              MemorySpace::Address buf, size_t size);
+    void submit_rwv_command(bool do_write, unsigned int nsid, loff_t pos,
+                            const IOSegment* iov, size_t iovcnt,
+                            AsyncCommandCallback&& callback);
+    void submit_child_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                              MemorySpace::Address buf, size_t buflen,
+                              const struct nvme_sgl_desc* descs, size_t ndescs,
+                              VectoredRequest* vreq,
+                              AsyncCommandCallback& callback);
+    /* Fail a request whose submission threw after submitted commands.
+     * Returns false if no command went out; vreq is then freed and the
+     * caller rethrows instead. */
+    bool abort_vectored(VectoredRequest* vreq, size_t submitted);
+    void complete_vectored(VectoredRequest* vreq, NVMeStatus status,
+                           const NVMeResult& result);
+    void release_vectored(VectoredRequest* vreq);
+    void submit_dsm_command(unsigned int nsid, const LBARange* ranges,
+                            size_t nranges, AsyncCommandCallback&& callback);
+    void submit_write_zeroes_command(unsigned int nsid, loff_t pos,
+                                     size_t size,
+                                     AsyncCommandCallback&& callback);
 
     AsyncCommand* submit_invoke_command(unsigned int cid,
                                         MemorySpace::Address entry,
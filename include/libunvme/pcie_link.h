@@ -34,6 +34,9 @@ public:
 
     virtual MemorySpace* map_bar(unsigned int bar_id) = 0;
 
+    /* Bus address of a memory BAR as seen by the device, or 0 if unknown. */
+    virtual uint64_t get_bar_address(unsigned int bar_id) { return 0; }
+
     virtual void send_config(const mcmq::SsdConfig& config) = 0;
 
     virtual void report(mcmq::SimResult& result) = 0;
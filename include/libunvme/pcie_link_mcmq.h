@@ -14,7 +14,10 @@
 
 class PCIeLinkMcmq : public PCIeLink {
 public:
-    PCIeLinkMcmq() : sock_fd(-1), peer_fd(-1) {}
+    /* One vsock port per simulated device. */
+    explicit PCIeLinkMcmq(unsigned int port = 9999)
+        : port(port), sock_fd(-1), peer_fd(-1)
+    {}
 
     virtual bool init();
 
@@ -27,6 +30,7 @@ public:
     void report(mcmq::SimResult& result);
 
 private:
+    unsigned int port;
     int sock_fd, peer_fd;
     std::mutex mutex, sock_mutex;
     std::atomic<uint32_t> read_id_counter;
@@ -27,6 +27,8 @@ public:
 
     MemorySpace* map_bar(unsigned int bar_id);
 
+    uint64_t get_bar_address(unsigned int bar_id);
+
     void send_config(const mcmq::SsdConfig& config) {}
 
     void report(mcmq::SimResult& result) {}
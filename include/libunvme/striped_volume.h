@@ -0,0 +1,123 @@
+#ifndef _STRIPED_VOLUME_H_
+#define _STRIPED_VOLUME_H_
+
+#include "nvme_driver.h"
+
+#include <vector>
+
+/* RAID-0 volume striped over namespaces of one or more NVMe drivers. Stripe
+ * n of the volume lives on member n mod N at offset (n / N) * stripe_size.
+ * Requests are split at stripe boundaries and fanned out to the members;
+ * the callback runs once after all parts complete, with the first error
+ * status.
+ *
+ * Buffers are addresses in the memory space of the first member. Members
+ * with a memory space of their own go through bounce buffers, which costs a
+ * copy per part. All drivers must be started before the volume is built. */
+class StripedVolume {
+public:
+    struct Member {
+        NVMeDriver* driver;
+        unsigned int nsid;
+    };
+
+    using AsyncCommandCallback = NVMeDriver::AsyncCommandCallback;
+
+    /* stripe_size must be a multiple of the block size of every member. */
+    StripedVolume(const std::vector<Member>& members, size_t stripe_size);
+
+    size_t get_member_count() const { return members.size(); }
+    size_t get_stripe_size() const { return stripe_size; }
+
+    /* Usable size in bytes: N times the smallest member rounded down to
+     * whole stripes. */
+    size_t get_capacity() const { return capacity; }
+
+    /* Largest block size of the members. Requests must be aligned to it. */
+    size_t get_block_size() const { return block_size; }
+
+    MemorySpace* get_memory_space() const
+    {
+        return members.front().driver->get_memory_space();
+    }
+
+    bool supports_deallocate() const;
+
+    /* Bind the calling thread to an I/O queue of every member. */
+    void set_thread_id(unsigned int thread_id);
+
+    /* Poll the polled queues the calling thread is bound to. */
+    unsigned int poll_completions();
+
+    void plug();
+    void unplug();
+
+    void read_async(loff_t pos, MemorySpace::Address buf, size_t size,
+                    AsyncCommandCallback&& callback)
+    {
+        submit_rw(false, pos, buf, size, std::move(callback));
+    }
+
+    void write_async(loff_t pos, MemorySpace::Address buf, size_t size,
+                     AsyncCommandCallback&& callback)
+    {
+        submit_rw(true, pos, buf, size, std::move(callback));
+    }
+
+    void deallocate_async(const NVMeDriver::LBARange* ranges, size_t nranges,
+                          AsyncCommandCallback&& callback);
+
+    void flush_async(AsyncCommandCallback&& callback);
+
+private:
+    struct StripeRequest {
+        std::atomic<unsigned int> pending;
+        std::atomic<NVMeDriver::NVMeStatus> status;
+        AsyncCommandCallback callback;
+
+        explicit StripeRequest(AsyncCommandCallback&& callback)
+            : pending(1), status(NVME_SC_SUCCESS),
+              callback(std::move(callback))
+        {}
+    };
+
+    std::vector<Member> members;
+    /* Whether the member shares the memory space of the first one. */
+    std::vector<bool> shared_memory;
+    size_t stripe_size;
+    size_t block_size;
+    size_t capacity;
+
+    /* Member holding byte pos of the volume and the offset there. */
+    unsigned int map_position(loff_t pos, loff_t& member_pos) const
+    {
+        size_t stripe = pos / stripe_size;
+
+        member_pos = (stripe / members.size()) * stripe_size +
+                     pos % stripe_size;
+        return stripe % members.size();
+    }
+
+    void check_range(loff_t pos, size_t size) const;
+
+    void submit_rw(bool do_write, loff_t pos, MemorySpace::Address buf,
+                   size_t size, AsyncCommandCallback&& callback);
+
+    /* Run submit, which issues one command completing sreq, with a
+     * reference on sreq held for the command. */
+    template <typename Submit>
+    void submit_child(StripeRequest* sreq, Submit&& submit);
+
+    void submit_part(StripeRequest* sreq, bool do_write, unsigned int idx,
+                     loff_t pos, MemorySpace::Address buf, size_t size);
+
+    /* Fail a request whose submission threw after submitted parts. Returns
+     * false if no part went out; sreq is then freed and the caller rethrows
+     * instead. */
+    bool abort_stripe(StripeRequest* sreq, size_t submitted);
+
+    static void complete_stripe(StripeRequest* sreq,
+                                NVMeDriver::NVMeStatus status);
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef _TRACER_H_
+#define _TRACER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Binary event tracer for the driver hot paths. Every thread appends
+ * fixed-size events to a ring buffer of its own, so recording is a
+ * timestamp read and a few stores: no lock, no formatting. The oldest
+ * events of a thread are overwritten once its ring wraps.
+ *
+ * Call sites use UNVME_TRACE_EVENT(), which compiles to nothing unless
+ * UNVME_TRACE is defined (cmake -DUNVME_TRACE=ON); its arguments are then
+ * not evaluated either. */
+class Tracer {
+public:
+    enum class EventType : uint16_t {
+        /* qid, cid; opcode, nsid */
+        SUBMIT,
+        /* qid; tail, whether MMIO was written */
+        SQ_DOORBELL,
+        /* qid; head */
+        CQ_DOORBELL,
+        /* vector; completions reaped */
+        IRQ,
+        /* qid, cid; status */
+        CQE,
+        /* qid; number of callbacks */
+        CALLBACK_BEGIN,
+        CALLBACK_END,
+        /* length; message type, address */
+        LINK_SEND,
+        /* length; message type */
+        LINK_RECV,
+        /* length; address */
+        MEM_READ,
+        MEM_WRITE,
+        NR_TYPES,
+    };
+
+    struct Event {
+        uint64_t timestamp;
+        EventType type;
+        uint16_t qid;
+        uint32_t id;
+        uint64_t arg0;
+        uint64_t arg1;
+    };
+
+    static constexpr bool enabled()
+    {
+#ifdef UNVME_TRACE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static void record(EventType type, uint16_t qid, uint32_t id,
+                       uint64_t arg0 = 0, uint64_t arg1 = 0)
+    {
+        auto* ring = thread_ring ? thread_ring : register_thread();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+        ring->events[head & (RING_SIZE - 1)] = {timestamp(), type, qid, id,
+                                                arg0, arg1};
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    /* Write the recorded events as a Chrome trace (JSON), which Perfetto
+     * and chrome://tracing open. Commands show up as async slices from
+     * submission to completion. Meant to be called once I/O has stopped;
+     * events recorded meanwhile may be torn. */
+    static bool export_chrome_trace(const std::filesystem::path& filename);
+
+private:
+    /* Events per thread; a power of two. */
+    static constexpr size_t RING_SIZE = 1UL << 16;
+
+    struct Ring {
+        uint32_t tid;
+        std::atomic<uint64_t> head;
+        Event events[RING_SIZE];
+    };
+
+    static thread_local Ring* thread_ring;
+    /* Rings outlive their threads so that they can be exported at the
+     * end. */
+    static std::mutex ring_mutex;
+    static std::vector<std::unique_ptr<Ring>> rings;
+
+    static Ring* register_thread();
+
+    /* TSC where available, nanoseconds otherwise. */
+    static uint64_t timestamp()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+};
+
+#ifdef UNVME_TRACE
+#define UNVME_TRACE_EVENT(type, ...) \
+    Tracer::record(Tracer::EventType::type, __VA_ARGS__)
+#else
+#define UNVME_TRACE_EVENT(type, ...) \
+    do {                             \
+    } while (0)
+#endif
+
+#endif
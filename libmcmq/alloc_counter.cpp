@@ -0,0 +1,119 @@
+#include "libmcmq/alloc_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+static thread_local uint64_t heap_allocations = 0;
+
+uint64_t thread_heap_allocations() { return heap_allocations; }
+
+static void* counted_alloc(std::size_t size, std::size_t align = 0)
+{
+    heap_allocations++;
+
+    if (size == 0) size = 1;
+    /* posix_memalign needs at least pointer alignment. */
+    if (align && align < sizeof(void*)) align = sizeof(void*);
+
+    for (;;) {
+        void* p = nullptr;
+
+        if (!align)
+            p = std::malloc(size);
+        else if (posix_memalign(&p, align, size))
+            p = nullptr;
+
+        if (p) return p;
+
+        auto handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+static void* counted_alloc_nothrow(std::size_t size,
+                                   std::size_t align = 0) noexcept
+{
+    try {
+        return counted_alloc(size, align);
+    } catch (std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) { return counted_alloc(size); }
+
+void* operator new[](std::size_t size) { return counted_alloc(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    return counted_alloc(size, static_cast<std::size_t>(align));
+}
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+    return counted_alloc(size, static_cast<std::size_t>(align));
+}
+
+void* operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void* operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size, static_cast<std::size_t>(align));
+}
+
+/* Aligned blocks come from posix_memalign, so every form frees with free. */
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
@@ -182,6 +182,23 @@ bool ConfigReader::load_ssd_config(const std::string& filename,
     return true;
 }
 
+static void load_volume(YAML::Node volume_node, HostConfig& config)
+{
+    config.volumes.push_back({});
+    auto& volume = config.volumes.back();
+
+    volume.nsid = volume_node["namespace"].as<unsigned int>(0);
+    volume.stripe_size = volume_node["stripe_size"].as<size_t>(128 << 10);
+
+    auto members = volume_node["members"];
+    for (size_t i = 0; i < members.size(); i++) {
+        YAML::Node member = members[i];
+
+        volume.members.push_back({member["device"].as<unsigned int>(0),
+                                  member["namespace"].as<unsigned int>(1)});
+    }
+}
+
 static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
 {
     config.flows.push_back({});
@@ -190,6 +207,27 @@ static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
     auto ns = flow_node["namespace"].as<uint32_t>(0);
     flow.nsid = ns;
 
+    auto completion_mode =
+        flow_node["completion_mode"].as<std::string>("interrupt");
+    if (completion_mode == "poll")
+        flow.completion_mode = CompletionMode::POLL;
+    else if (completion_mode == "hybrid")
+        flow.completion_mode = CompletionMode::HYBRID;
+    else
+        flow.completion_mode = CompletionMode::INTERRUPT;
+
+    flow.irq_coalescing = flow_node["irq_coalescing"].as<bool>(true);
+
+    auto priority = flow_node["priority"].as<std::string>("medium");
+    if (priority == "urgent")
+        flow.priority = QueuePriority::URGENT;
+    else if (priority == "high")
+        flow.priority = QueuePriority::HIGH;
+    else if (priority == "low")
+        flow.priority = QueuePriority::LOW;
+    else
+        flow.priority = QueuePriority::MEDIUM;
+
     auto type = flow_node["type"].as<std::string>("synthetic");
     if (type == "synthetic") {
         flow.type = FlowType::SYNTHETIC;
@@ -200,6 +238,7 @@ static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
             flow_node["request_count"].as<size_t>(10000);
 
         flow.synthetic.read_ratio = flow_node["read_ratio"].as<double>(0.5);
+        flow.synthetic.trim_ratio = flow_node["trim_ratio"].as<double>(0.0);
 
         auto req_size_dist =
             flow_node["request_size_distribution"].as<std::string>("constant");
@@ -251,6 +290,32 @@ bool ConfigReader::load_host_config(const std::string& filename,
 
     config.io_queue_depth = root["io_queue_depth"].as<unsigned int>(1024);
 
+    YAML::Node irq_coalescing = root["irq_coalescing"];
+    config.irq_coalescing_threshold =
+        irq_coalescing["threshold"].as<unsigned int>(0);
+    config.irq_coalescing_time = irq_coalescing["time"].as<unsigned int>(0);
+
+    YAML::Node arbitration = root["arbitration"];
+    config.wrr_arbitration = arbitration.IsDefined();
+    config.arbitration_burst = arbitration["burst"].as<unsigned int>(7);
+    config.high_priority_weight = arbitration["high"].as<unsigned int>(8);
+    config.medium_priority_weight = arbitration["medium"].as<unsigned int>(4);
+    config.low_priority_weight = arbitration["low"].as<unsigned int>(1);
+
+    config.command_timeout = root["command_timeout"].as<unsigned int>(0);
+
+    YAML::Node hedging = root["hedging"];
+    config.hedge_percentile = hedging["percentile"].as<double>(0);
+
+    YAML::Node telemetry = root["telemetry"];
+    config.telemetry_interval = telemetry["interval"].as<unsigned int>(0);
+
+    config.queue_latency_stats = root["queue_latency_stats"].as<bool>(false);
+
+    config.lazy_queue_creation = root["lazy_queue_creation"].as<bool>(false);
+    config.cmb_submission_queues =
+        root["cmb_submission_queues"].as<bool>(false);
+
     auto& flash_config = ssd_config.flash_config();
     size_t chip_capacity_sects =
         flash_config.nr_dies_per_chip() * flash_config.nr_planes_per_die() *
@@ -265,6 +330,12 @@ bool ConfigReader::load_host_config(const std::string& filename,
         config.namespaces.emplace(nsid, NamespaceDefinition{ns_capacity_sects});
     }
 
+    auto volumes = root["volumes"];
+    for (size_t i = 0; i < volumes.size(); i++) {
+        YAML::Node volume = volumes[i];
+        load_volume(volume, config);
+    }
+
     auto flows = root["flows"];
     for (int i = 0; i < flows.size(); i++) {
         YAML::Node flow = flows[i];
@@ -1,32 +1,38 @@
 #include "io_thread.h"
 #include "io_thread_synthetic.h"
+#include "alloc_counter.h"
 
 #include "spdlog/spdlog.h"
 
 IOThread::IOThread(NVMeDriver* driver, MemorySpace* memory_space, int thread_id,
-                   unsigned int queue_depth, size_t request_count)
-    : driver(driver), memory_space(memory_space), thread_id(thread_id),
-      queue_depth(queue_depth), request_count(request_count),
-      nr_submitted_requests(0), nr_completed_requests(0), inflight_requests(0),
+                   size_t request_count)
+    : driver(driver), volume(nullptr), memory_space(memory_space),
+      thread_id(thread_id),
+      request_count(request_count), nr_submitted_requests(0),
+      nr_completed_requests(0),
       nr_completed_read_requests(0), nr_completed_write_requests(0),
+      nr_completed_trim_requests(0),
       transferred_bytes_total(0), transferred_bytes_read(0),
-      transferred_bytes_write(0)
+      transferred_bytes_write(0), submit_heap_allocations(0),
+      callback_submit_heap_allocations(0), nr_callback_submissions(0)
 {
     stats.thread_id = thread_id;
+    polled = driver->get_completion_mode(thread_id) !=
+             NVMeDriver::CompletionMode::INTERRUPT;
 }
 
 std::unique_ptr<IOThread>
 IOThread::create_thread(NVMeDriver* driver, MemorySpace* memory_space,
-                        int thread_id, unsigned int queue_depth,
-                        size_t sector_size, size_t max_lsa,
+                        int thread_id, size_t sector_size, size_t max_lsa,
                         const FlowDefinition& def)
 {
     switch (def.type) {
     case FlowType::SYNTHETIC:
         return std::make_unique<IOThreadSynthetic>(
-            driver, memory_space, thread_id, def.nsid, queue_depth, sector_size,
-            max_lsa, def.synthetic.seed, def.synthetic.request_count,
-            def.synthetic.read_ratio, def.synthetic.request_size_distribution,
+            driver, memory_space, thread_id, def.nsid, sector_size, max_lsa,
+            def.synthetic.seed, def.synthetic.request_count,
+            def.synthetic.read_ratio, def.synthetic.trim_ratio,
+            def.synthetic.request_size_distribution,
             def.synthetic.request_size_mean,
             def.synthetic.request_size_variance,
             def.synthetic.address_distribution, def.synthetic.zipfian_alpha,
@@ -40,7 +46,10 @@ IOThread::create_thread(NVMeDriver* driver, MemorySpace* memory_space,
 void IOThread::run()
 {
     thread = std::thread([this]() {
-        driver->set_thread_id(thread_id);
+        if (volume)
+            volume->set_thread_id(thread_id);
+        else
+            driver->set_thread_id(thread_id);
 
         auto start = std::chrono::system_clock::now();
         this->run_impl();
@@ -51,6 +60,7 @@ void IOThread::run()
         stats.request_count = nr_completed_requests;
         stats.read_request_count = nr_completed_read_requests;
         stats.write_request_count = nr_completed_write_requests;
+        stats.trim_request_count = nr_completed_trim_requests;
 
         stats.iops_total = nr_completed_requests / delta.count();
         stats.iops_read = nr_completed_read_requests / delta.count();
@@ -60,10 +70,16 @@ void IOThread::run()
         stats.bandwidth_read = transferred_bytes_read / delta.count();
         stats.bandwidth_write = transferred_bytes_write / delta.count();
 
-        spdlog::info(
-            "Thread {} stats: Request count (total/read/write): {}/{}/{}",
-            thread_id, nr_completed_requests, nr_completed_read_requests,
-            nr_completed_write_requests);
+        stats.submit_heap_allocations = submit_heap_allocations;
+        stats.callback_submit_heap_allocations =
+            callback_submit_heap_allocations;
+        stats.callback_submissions = nr_callback_submissions;
+
+        spdlog::info("Thread {} stats: Request count (total/read/write/trim): "
+                     "{}/{}/{}/{}",
+                     thread_id, nr_completed_requests,
+                     nr_completed_read_requests, nr_completed_write_requests,
+                     nr_completed_trim_requests);
         spdlog::info(
             "Thread {} stats: IOPS (total/read/write): {:.2f}/{:.2f}/{:.2f}",
             thread_id, stats.iops_total, stats.iops_read, stats.iops_write);
@@ -71,6 +87,14 @@ void IOThread::run()
                      "{:.2f}/{:.2f}/{:.2f}",
                      thread_id, stats.bandwidth_total, stats.bandwidth_read,
                      stats.bandwidth_write);
+#ifdef MCMQ_COUNT_ALLOCATIONS
+        spdlog::info("Thread {} stats: Heap allocations in submission "
+                     "(batched/callback): {}/{} ({}/{} requests)",
+                     thread_id, submit_heap_allocations,
+                     callback_submit_heap_allocations,
+                     nr_submitted_requests - nr_callback_submissions,
+                     nr_callback_submissions);
+#endif
     });
 }
 
@@ -84,7 +108,9 @@ void IOThread::submit_io_request(bool do_write, unsigned int nsid, loff_t pos,
 {
     auto* req = new IORequest();
 
+    req->thread = this;
     req->do_write = do_write;
+    req->do_trim = false;
     req->nsid = nsid;
     req->pos = pos;
     req->buf = memory_space->allocate_pages(size);
@@ -94,10 +120,26 @@ void IOThread::submit_io_request(bool do_write, unsigned int nsid, loff_t pos,
 
     req->arrival_time = std::chrono::system_clock::now();
 
-    if (inflight_requests >= queue_depth) {
-        waiting_requests.push(req);
-        return;
-    }
+    /* The driver queues the request if the device queue is full, and waits
+     * for completions once its overflow queue is full too. */
+    submit_to_device(req);
+}
+
+void IOThread::submit_trim_request(unsigned int nsid, loff_t pos, size_t size)
+{
+    auto* req = new IORequest();
+
+    req->thread = this;
+    req->do_write = false;
+    req->do_trim = true;
+    req->nsid = nsid;
+    req->pos = pos;
+    req->buf = 0;
+    req->size = size;
+
+    nr_submitted_requests++;
+
+    req->arrival_time = std::chrono::system_clock::now();
 
     submit_to_device(req);
 }
@@ -109,33 +151,66 @@ void IOThread::submit_to_device(IORequest* req)
     loff_t pos = req->pos;
     size_t size = req->size;
 
-    auto callback = [this, req](NVMeDriver::NVMeStatus status,
-                                const NVMeDriver::NVMeResult& res) {
-        this->notify_request_completion(req);
-    };
-
-    inflight_requests++;
-
     spdlog::trace("Submitting {} request to device nsid={} pos={} size={}",
-                  do_write ? "write" : "read", nsid, pos, size);
+                  req->do_trim ? "trim" : (do_write ? "write" : "read"), nsid,
+                  pos, size);
 
     req->enqueued_time = std::chrono::system_clock::now();
 
+    /* The submission path is expected to be allocation-free; only commands
+     * parked on a full queue allocate. */
+    auto allocs = thread_heap_allocations();
+
+    if (volume) {
+        auto callback = [req](NVMeDriver::NVMeStatus status,
+                              const NVMeDriver::NVMeResult& result) {
+            NVMeDriver::BatchCompletion completion = {req, status, result};
+            complete_requests(&completion, 1);
+        };
+
+        if (req->do_trim) {
+            NVMeDriver::LBARange range = {pos, size};
+
+            volume->deallocate_async(&range, 1, std::move(callback));
+        } else if (do_write) {
+            volume->write_async(pos, req->buf, size, std::move(callback));
+        } else {
+            volume->read_async(pos, req->buf, size, std::move(callback));
+        }
+
+        callback_submit_heap_allocations += thread_heap_allocations() - allocs;
+        nr_callback_submissions++;
+        return;
+    }
+
+    if (req->do_trim) {
+        NVMeDriver::LBARange range = {pos, size};
+
+        driver->deallocate_async(
+            nsid, &range, 1,
+            [req](NVMeDriver::NVMeStatus status,
+                  const NVMeDriver::NVMeResult& result) {
+                NVMeDriver::BatchCompletion completion = {req, status, result};
+                complete_requests(&completion, 1);
+            });
+
+        callback_submit_heap_allocations += thread_heap_allocations() - allocs;
+        nr_callback_submissions++;
+        return;
+    }
+
     if (do_write) {
-        driver->write_async(nsid, pos, req->buf, size, std::move(callback));
+        driver->write_batched(nsid, pos, req->buf, size, req);
     } else {
-        driver->read_async(nsid, pos, req->buf, size, std::move(callback));
+        driver->read_batched(nsid, pos, req->buf, size, req);
     }
+
+    submit_heap_allocations += thread_heap_allocations() - allocs;
 }
 
-void IOThread::notify_request_completion(IORequest* req)
+void IOThread::record_latency(IORequest* req)
 {
-    std::lock_guard<std::mutex> lock(completion_mutex);
-    auto now = std::chrono::system_clock::now();
-
-    completed_requests.push(req);
-    completion_cv.notify_all();
-
+    auto now = req->completion_time;
     auto device_response_time_us =
         std::chrono::duration_cast<std::chrono::microseconds>(
             now - req->enqueued_time)
@@ -149,11 +224,63 @@ void IOThread::notify_request_completion(IORequest* req)
     hdr_record_value(stats.e2e_latency_hist.get(), e2e_latency_us);
 }
 
+void IOThread::complete_requests(
+    const NVMeDriver::BatchCompletion* completions, size_t count)
+{
+    auto now = std::chrono::system_clock::now();
+    size_t i = 0;
+
+    /* A batch holds completions of every thread sharing the queue. Requests
+     * of one thread are handed over under a single lock. Completions of a
+     * polled queue may be reaped by another thread bound to the same queue,
+     * but nobody sleeps on the condition variable.
+     *
+     * Completions of a thread may be reaped by several threads at once
+     * (shared queues, volume members), so the statistics are left to the
+     * owning thread. */
+    while (i < count) {
+        auto* thread = static_cast<IORequest*>(completions[i].context)->thread;
+        size_t end = i;
+
+        while (end < count &&
+               static_cast<IORequest*>(completions[end].context)->thread ==
+                   thread)
+            static_cast<IORequest*>(completions[end++].context)
+                ->completion_time = now;
+
+        std::unique_lock<std::mutex> lock(thread->completion_mutex);
+
+        for (; i < end; i++)
+            thread->completed_requests.push(
+                static_cast<IORequest*>(completions[i].context));
+
+        lock.unlock();
+
+        if (!thread->polled) thread->completion_cv.notify_all();
+    }
+}
+
 void IOThread::wait_for_completed_requests()
 {
     std::vector<IORequest*> reqs;
 
-    {
+    if (polled) {
+        std::unique_lock<std::mutex> lock(completion_mutex);
+
+        while (completed_requests.empty()) {
+            lock.unlock();
+            if (volume)
+                volume->poll_completions();
+            else
+                driver->poll_completions();
+            lock.lock();
+        }
+
+        while (!completed_requests.empty()) {
+            reqs.push_back(completed_requests.front());
+            completed_requests.pop();
+        }
+    } else {
         std::unique_lock<std::mutex> lock(completion_mutex);
 
         while (completed_requests.empty())
@@ -166,24 +293,58 @@ void IOThread::wait_for_completed_requests()
         }
     }
 
+    /* Refills triggered by this batch share one doorbell write. */
+    plug();
+
     for (auto&& req : reqs)
         process_completed_request(req);
+
+    unplug();
+}
+
+void IOThread::plug()
+{
+    if (volume)
+        volume->plug();
+    else
+        driver->plug();
+}
+
+void IOThread::unplug()
+{
+    if (volume)
+        volume->unplug();
+    else
+        driver->unplug();
+}
+
+bool IOThread::supports_deallocate() const
+{
+    return volume ? volume->supports_deallocate()
+                  : driver->supports_deallocate();
 }
 
 void IOThread::process_completed_request(IORequest* req)
 {
     static const size_t LOG_STEP = 10000;
 
-    inflight_requests--;
     nr_completed_requests++;
-    transferred_bytes_total += req->size;
-
-    memory_space->free(req->buf, req->size);
+    record_latency(req);
 
     if (nr_completed_requests % LOG_STEP == 0)
         spdlog::info("Thread {} {}/{} requests completed", thread_id,
                      nr_completed_requests, request_count);
 
+    if (req->do_trim) {
+        nr_completed_trim_requests++;
+        on_request_completed();
+        delete req;
+        return;
+    }
+
+    transferred_bytes_total += req->size;
+    memory_space->free(req->buf, req->size);
+
     if (req->do_write) {
         nr_completed_write_requests++;
         transferred_bytes_write += req->size;
@@ -192,12 +353,6 @@ void IOThread::process_completed_request(IORequest* req)
         transferred_bytes_read += req->size;
     }
 
-    while (!waiting_requests.empty() && inflight_requests < queue_depth) {
-        auto req = waiting_requests.front();
-        waiting_requests.pop();
-        submit_to_device(req);
-    }
-
     on_request_completed();
 
     delete req;
@@ -5,15 +5,16 @@
 
 IOThreadSynthetic::IOThreadSynthetic(
     NVMeDriver* driver, MemorySpace* memory_space, int thread_id,
-    unsigned int nsid, unsigned int queue_depth, unsigned int sector_size,
-    size_t max_lsa, unsigned int seed, size_t request_count, double read_ratio,
+    unsigned int nsid, unsigned int sector_size, size_t max_lsa,
+    unsigned int seed, size_t request_count, double read_ratio,
+    double trim_ratio,
     RequestSizeDistribution request_size_distribution, int request_size_mean,
     int request_size_variance, AddressDistribution addr_distribution,
     double zipfian_alpha, unsigned int addr_alignment,
     unsigned int average_enqueued_requests)
-    : IOThread(driver, memory_space, thread_id, queue_depth, request_count),
-      nsid(nsid), sector_size(sector_size), max_lsa(max_lsa), generator(seed),
-      read_ratio(read_ratio),
+    : IOThread(driver, memory_space, thread_id, request_count), nsid(nsid),
+      sector_size(sector_size), max_lsa(max_lsa), generator(seed),
+      read_ratio(read_ratio), trim_ratio(trim_ratio),
       request_size_distribution(request_size_distribution),
       request_size_mean(request_size_mean),
       request_size_variance(request_size_variance),
@@ -22,14 +23,16 @@ IOThreadSynthetic::IOThreadSynthetic(
       average_enqueued_requests(average_enqueued_requests)
 {}
 
-void IOThreadSynthetic::generate_request(bool& do_write, loff_t& pos,
-                                         size_t& size)
+void IOThreadSynthetic::generate_request(bool& do_trim, bool& do_write,
+                                         loff_t& pos, size_t& size)
 {
     unsigned long pos_sector;
     int size_sectors;
+    std::bernoulli_distribution trim_dist(trim_ratio);
     std::bernoulli_distribution request_type_dist(read_ratio);
 
-    do_write = !request_type_dist(generator);
+    do_trim = trim_ratio > 0 && trim_dist(generator);
+    do_write = !do_trim && !request_type_dist(generator);
 
     switch (request_size_distribution) {
     case RequestSizeDistribution::CONSTANT:
@@ -66,29 +69,42 @@ void IOThreadSynthetic::generate_request(bool& do_write, loff_t& pos,
     size = (size_t)size_sectors * sector_size;
 }
 
-void IOThreadSynthetic::on_request_completed()
+void IOThreadSynthetic::submit_request()
 {
-    if (nr_submitted_requests < request_count) {
-        bool do_write;
-        loff_t pos;
-        size_t size;
+    bool do_trim, do_write;
+    loff_t pos;
+    size_t size;
+
+    generate_request(do_trim, do_write, pos, size);
 
-        generate_request(do_write, pos, size);
+    if (do_trim)
+        submit_trim_request(nsid, pos, size);
+    else
         submit_io_request(do_write, nsid, pos, size);
-    }
 }
 
-void IOThreadSynthetic::run_impl()
+void IOThreadSynthetic::on_request_completed()
 {
-    for (int i = 0; i < average_enqueued_requests; i++) {
-        bool do_write;
-        loff_t pos;
-        size_t size;
+    if (nr_submitted_requests < request_count) submit_request();
+}
 
-        generate_request(do_write, pos, size);
-        submit_io_request(do_write, nsid, pos, size);
+void IOThreadSynthetic::run_impl()
+{
+    /* Checked here as the thread may have been given a volume. */
+    if (trim_ratio > 0 && !supports_deallocate()) {
+        spdlog::warn("Thread {}: device does not support deallocate, "
+                     "disabling trims",
+                     stats.thread_id);
+        trim_ratio = 0;
     }
 
+    plug();
+
+    for (int i = 0; i < average_enqueued_requests; i++)
+        submit_request();
+
+    unplug();
+
     while (nr_completed_requests < request_count) {
         wait_for_completed_requests();
     }
@@ -189,6 +189,7 @@ static json export_thread_stats(const IOThread::Stats& stats)
     root["total_requests"] = stats.request_count;
     root["read_requests"] = stats.read_request_count;
     root["write_requests"] = stats.write_request_count;
+    root["trim_requests"] = stats.trim_request_count;
 
     root["iops_total"] = stats.iops_total;
     root["iops_read"] = stats.iops_read;
@@ -197,6 +198,12 @@ static json export_thread_stats(const IOThread::Stats& stats)
     root["bandwidth_total"] = stats.bandwidth_total;
     root["bandwidth_read"] = stats.bandwidth_read;
     root["bandwidth_write"] = stats.bandwidth_write;
+#ifdef MCMQ_COUNT_ALLOCATIONS
+    root["submit_heap_allocations"] = stats.submit_heap_allocations;
+    root["callback_submit_heap_allocations"] =
+        stats.callback_submit_heap_allocations;
+    root["callback_submissions"] = stats.callback_submissions;
+#endif
 
     root["device_response_time_histogram"] =
         export_histogram(stats.device_response_time_hist.get());
@@ -219,6 +226,128 @@ static json export_thread_stats(const IOThread::Stats& stats)
     return root;
 }
 
+static json export_irq_stats(const NVMeDriver::IrqStats& stats)
+{
+    json root = json::object();
+
+    root["queue_id"] = stats.qid;
+    root["irq_count"] = stats.irq_count;
+    root["cqe_count"] = stats.cqe_count;
+    root["cqes_per_irq"] =
+        stats.irq_count ? (double)stats.cqe_count / stats.irq_count : 0.0;
+
+    return root;
+}
+
+static json export_driver_queue_stats(const NVMeDriver::QueueStats& stats)
+{
+    json root = json::object();
+    uint64_t latency_count = 0;
+
+    for (auto&& bucket : stats.latency_hist)
+        latency_count += bucket.count;
+
+    root["queue_id"] = stats.qid;
+    root["sq_in_cmb"] = stats.sq_in_cmb;
+    root["submitted"] = stats.submitted;
+    root["completed"] = stats.completed;
+    root["in_flight"] = stats.in_flight;
+    root["max_in_flight"] = stats.max_in_flight;
+    root["mean_in_flight"] =
+        stats.submitted ? (double)stats.in_flight_sum / stats.submitted : 0.0;
+    root["sq_doorbells"] = stats.sq_doorbells;
+    root["sq_mmio_writes"] = stats.sq_mmio_writes;
+    root["sqes_per_doorbell"] =
+        stats.sq_doorbells ? (double)stats.submitted / stats.sq_doorbells
+                           : 0.0;
+    root["irq_count"] = stats.irq_count;
+    root["cqes_per_irq"] =
+        stats.irq_count ? (double)stats.irq_cqe_count / stats.irq_count : 0.0;
+    root["prp_list_pooled"] = stats.prp_list_pooled;
+    root["prp_list_allocs"] = stats.prp_list_allocs;
+
+    /* Microseconds, like the thread histograms. Values are bucket upper
+     * bounds. */
+    json histogram = json::array();
+    uint64_t cumulative = 0;
+
+    for (auto&& bucket : stats.latency_hist) {
+        json entry = json::object();
+
+        cumulative += bucket.count;
+        entry["value"] = bucket.limit_ns / 1000.0;
+        entry["percentile"] = 100.0 * cumulative / latency_count;
+        entry["total_count"] = cumulative;
+
+        histogram.push_back(entry);
+    }
+
+    root["device_latency_histogram"] = histogram;
+    root["device_latency_mean"] =
+        latency_count ? stats.latency_sum_ns / 1000.0 / latency_count : 0.0;
+
+    return root;
+}
+
+static json export_telemetry(const TelemetrySampler::Telemetry& telemetry)
+{
+    json root = json::object();
+
+    root["interval_ms"] = telemetry.interval_ms;
+
+    json smart_samples = json::array();
+
+    for (auto&& sample : telemetry.smart_samples) {
+        json entry = json::object();
+
+        entry["time"] = sample.time;
+        entry["critical_warning"] = sample.critical_warning;
+        entry["temperature"] = sample.temperature;
+        entry["percent_used"] = sample.percent_used;
+        entry["data_units_read"] = sample.data_units_read;
+        entry["data_units_written"] = sample.data_units_written;
+        entry["host_reads"] = sample.host_reads;
+        entry["host_writes"] = sample.host_writes;
+        entry["media_errors"] = sample.media_errors;
+        entry["error_log_entries"] = sample.error_log_entries;
+
+        smart_samples.push_back(entry);
+    }
+    root["smart_samples"] = smart_samples;
+
+    json async_events = json::array();
+
+    for (auto&& record : telemetry.async_events) {
+        json entry = json::object();
+
+        entry["time"] = record.time;
+        entry["type"] = record.event.type;
+        entry["info"] = record.event.info;
+        entry["log_page"] = record.event.log_page;
+
+        async_events.push_back(entry);
+    }
+    root["async_events"] = async_events;
+
+    json error_log = json::array();
+
+    for (auto&& record : telemetry.error_log) {
+        json entry = json::object();
+
+        entry["error_count"] = record.error_count;
+        entry["sqid"] = record.sqid;
+        entry["cmdid"] = record.cmdid;
+        entry["status"] = record.status;
+        entry["lba"] = record.lba;
+        entry["nsid"] = record.nsid;
+
+        error_log.push_back(entry);
+    }
+    root["error_log"] = error_log;
+
+    return root;
+}
+
 static void export_host_result(json& root, const HostResult& host_result)
 {
     json thread_stats = json::array();
@@ -227,6 +356,29 @@ static void export_host_result(json& root, const HostResult& host_result)
         thread_stats.push_back(export_thread_stats(stats));
 
     root["host_thread_stats"] = thread_stats;
+
+    json irq_stats = json::array();
+
+    for (auto&& stats : host_result.irq_stats)
+        irq_stats.push_back(export_irq_stats(stats));
+
+    root["host_irq_stats"] = irq_stats;
+
+    json queue_stats = json::array();
+
+    for (auto&& stats : host_result.queue_stats)
+        queue_stats.push_back(export_driver_queue_stats(stats));
+
+    root["host_queue_stats"] = queue_stats;
+
+    json hedge_stats = json::object();
+
+    hedge_stats["issued"] = host_result.hedge_stats.issued;
+    hedge_stats["won"] = host_result.hedge_stats.won;
+
+    root["host_hedge_stats"] = hedge_stats;
+
+    root["host_telemetry"] = export_telemetry(host_result.telemetry);
 }
 
 void ResultExporter::export_result(const std::string& filename,
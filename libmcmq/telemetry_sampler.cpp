@@ -0,0 +1,158 @@
+#include "libmcmq/telemetry_sampler.h"
+
+#include "spdlog/spdlog.h"
+
+#include <cstring>
+#include <endian.h>
+
+/* Low 64 bits of a little-endian 128-bit SMART counter. */
+static uint64_t smart_counter(const __u8* value)
+{
+    uint64_t low;
+
+    memcpy(&low, value, sizeof(low));
+    return le64toh(low);
+}
+
+TelemetrySampler::TelemetrySampler(NVMeDriver* driver,
+                                   unsigned int interval_ms)
+    : driver(driver), interval_ms(interval_ms), sampling(false),
+      start_time(std::chrono::steady_clock::now()), stopping(false)
+{
+    telemetry.interval_ms = interval_ms;
+
+    driver->set_async_event_callback(
+        [this](const NVMeDriver::AsyncEvent& event) {
+            on_async_event(event);
+        });
+}
+
+double TelemetrySampler::elapsed() const
+{
+    std::chrono::duration<double> delta =
+        std::chrono::steady_clock::now() - start_time;
+
+    return delta.count();
+}
+
+void TelemetrySampler::start()
+{
+    start_time = std::chrono::steady_clock::now();
+
+    if (!interval_ms || !take_sample()) return;
+
+    sampling = true;
+    stopping = false;
+
+    thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!stop_cv.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                                 [this]() { return stopping; })) {
+            lock.unlock();
+            bool ok = take_sample();
+            lock.lock();
+
+            if (!ok) break;
+        }
+    });
+}
+
+void TelemetrySampler::stop()
+{
+    if (!sampling) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+
+    if (thread.joinable()) thread.join();
+
+    sampling = false;
+
+    if (take_sample()) read_error_log();
+}
+
+TelemetrySampler::Telemetry TelemetrySampler::get_telemetry()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return telemetry;
+}
+
+void TelemetrySampler::on_async_event(const NVMeDriver::AsyncEvent& event)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    telemetry.async_events.push_back({elapsed(), event});
+}
+
+bool TelemetrySampler::take_sample()
+{
+    struct nvme_smart_log log;
+    SmartSample sample;
+
+    try {
+        driver->get_smart_log(&log);
+    } catch (const NVMeDriver::DeviceIOError&) {
+        spdlog::warn("SMART log unavailable, telemetry sampling stopped");
+        return false;
+    }
+
+    sample.time = elapsed();
+    sample.critical_warning = log.critical_warning;
+    sample.temperature = log.temperature[0] | log.temperature[1] << 8;
+    sample.percent_used = log.percent_used;
+    sample.data_units_read = smart_counter(log.data_units_read);
+    sample.data_units_written = smart_counter(log.data_units_written);
+    sample.host_reads = smart_counter(log.host_reads);
+    sample.host_writes = smart_counter(log.host_writes);
+    sample.media_errors = smart_counter(log.media_errors);
+    sample.error_log_entries = smart_counter(log.num_err_log_entries);
+
+    if (sample.critical_warning)
+        spdlog::warn("SMART critical warning {:#x} at {:.3f}s",
+                     sample.critical_warning, sample.time);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    telemetry.smart_samples.push_back(sample);
+
+    return true;
+}
+
+void TelemetrySampler::read_error_log()
+{
+    std::vector<struct nvme_error_log_entry> entries(MAX_ERROR_LOG_ENTRIES);
+    size_t count;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto& samples = telemetry.smart_samples;
+    uint64_t first = samples.front().error_log_entries;
+    uint64_t last = samples.back().error_log_entries;
+    lock.unlock();
+
+    if (last == first) return;
+
+    try {
+        count = driver->get_error_log(entries.data(), entries.size());
+    } catch (const NVMeDriver::DeviceIOError&) {
+        return;
+    }
+
+    lock.lock();
+
+    /* Only entries logged during the run. */
+    for (size_t i = 0; i < count; i++) {
+        const auto& entry = entries[i];
+        uint64_t error_count = le64toh(entry.error_count);
+
+        if (error_count <= first) continue;
+
+        telemetry.error_log.push_back(
+            {error_count, le16toh(entry.sqid), le16toh(entry.cmdid),
+             (unsigned int)le16toh(entry.status_field) >> 1,
+             le64toh(entry.lba), le32toh(entry.nsid)});
+    }
+}
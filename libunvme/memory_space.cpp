@@ -1,4 +1,5 @@
 #include "libunvme/memory_space.h"
+#include "libunvme/tracer.h"
 
 #include "spdlog/spdlog.h"
 
@@ -131,7 +132,7 @@ void MemorySpace::free_pages(Address addr, size_t len)
 
 void MemorySpace::read(Address addr, void* buf, size_t len)
 {
-    spdlog::trace("MemorySpace::read({:#x}, {}, {})", addr, buf, len);
+    UNVME_TRACE_EVENT(MEM_READ, 0, len, addr);
 
     addr -= iova_base;
     assert(addr < map_size && addr + len <= map_size);
@@ -151,7 +152,7 @@ void MemorySpace::read(Address addr, void* buf, size_t len)
 
 void MemorySpace::write(Address addr, const void* buf, size_t len)
 {
-    spdlog::trace("MemorySpace::write({:#x}, {}, {})", addr, buf, len);
+    UNVME_TRACE_EVENT(MEM_WRITE, 0, len, addr);
 
     addr -= iova_base;
     assert(addr < map_size && addr + len <= map_size);
@@ -1,18 +1,158 @@
 #include "libunvme/nvme_driver.h"
+#include "libunvme/tracer.h"
 
 #include "spdlog/spdlog.h"
 
 #include <boost/endian/conversion.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstddef>
 #include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace endian = boost::endian;
 
 #define SQ_SIZE(nvmeq) ((nvmeq)->depth << ((nvmeq)->sqe_shift))
 #define CQ_SIZE(nvmeq) ((nvmeq)->depth * sizeof(NVMeDriver::NVMeCompletion))
 
-thread_local struct NVMeDriver::NVMeQueue* NVMeDriver::thread_io_queue =
-    nullptr;
+/* Number of polls before a synchronous waiter parks on the futex. */
+#define WAIT_SPIN_COUNT 2000
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static inline void futex_wait(std::atomic<uint32_t>* addr, uint32_t val)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE,
+              val, nullptr, nullptr, 0);
+}
+
+static inline void futex_wake(std::atomic<uint32_t>* addr)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+              INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline void sgl_set_data(struct nvme_sgl_desc* sge, uint64_t addr,
+                                uint32_t len)
+{
+    sge->addr = endian::native_to_little(addr);
+    sge->length = endian::native_to_little(len);
+    sge->type = NVME_SGL_FMT_DATA_DESC << 4;
+}
+
+static inline void sgl_set_bit_bucket(struct nvme_sgl_desc* sge, uint32_t len)
+{
+    sge->addr = 0;
+    sge->length = endian::native_to_little(len);
+    sge->type = NVME_SGL_FMT_BIT_BUCKET_DESC << 4;
+}
+
+static inline void sgl_set_seg(struct nvme_sgl_desc* sge, uint64_t addr,
+                               size_t entries, bool last)
+{
+    sge->addr = endian::native_to_little(addr);
+    sge->length = endian::native_to_little(
+        (uint32_t)(entries * sizeof(struct nvme_sgl_desc)));
+    sge->type = (last ? NVME_SGL_FMT_LAST_SEG_DESC : NVME_SGL_FMT_SEG_DESC)
+                << 4;
+}
+
+static void init_rw_command(struct nvme_command* cmd, bool do_write,
+                            unsigned int nsid, loff_t pos, size_t size,
+                            unsigned int lba_shift)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->rw.opcode = (do_write ? nvme_cmd_write : nvme_cmd_read);
+    cmd->rw.nsid = endian::native_to_little(nsid);
+    cmd->rw.slba = endian::native_to_little(pos >> lba_shift);
+    cmd->rw.length = endian::native_to_little((size >> lba_shift) - 1);
+}
+
+/* True if moving a doorbell from old to new_idx crossed the EventIdx the
+ * controller asked to be notified at. */
+static inline bool dbbuf_need_event(uint16_t event_idx, uint16_t new_idx,
+                                    uint16_t old)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
+/* Update the shadow doorbell and return true if an MMIO doorbell write is
+ * still required. */
+static bool dbbuf_update_and_check_event(uint16_t value, uint32_t* db,
+                                         uint32_t* ei)
+{
+    uint16_t old = endian::little_to_native(
+        __atomic_load_n(db, __ATOMIC_RELAXED));
+
+    /* Queue entries must be visible before the new shadow value. */
+    __atomic_store_n(db, endian::native_to_little((uint32_t)value),
+                     __ATOMIC_RELEASE);
+
+    /* And the shadow value before EventIdx is read. */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint16_t event_idx =
+        endian::little_to_native(__atomic_load_n(ei, __ATOMIC_RELAXED));
+
+    return dbbuf_need_event(event_idx, value, old);
+}
+
+/* Latency histogram bucket: 8 linear sub-buckets per power of two
+ * nanoseconds. */
+static inline unsigned int latency_bucket(uint64_t ns)
+{
+    if (ns < 8) return ns;
+
+    unsigned int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+/* Counters with a single writer need no atomic read-modify-write. */
+static inline void counter_add(std::atomic<uint64_t>& counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+/* Exclusive upper bound of a latency bucket. */
+static inline uint64_t latency_bucket_limit(unsigned int bucket)
+{
+    bucket++;
+    if (bucket < 8) return bucket;
+
+    unsigned int msb = bucket / 8 + 2;
+    if (msb > 63) return UINT64_MAX;
+    return (8ULL + bucket % 8) << (msb - 3);
+}
+
+thread_local NVMeDriver::ThreadContext
+    NVMeDriver::thread_contexts[NVMeDriver::MAX_DRIVERS];
+std::atomic<uint32_t> NVMeDriver::used_driver_slots(0);
+/* Instance numbers start at 1 so that zeroed contexts match no driver. */
+std::atomic<uint64_t> NVMeDriver::next_instance(1);
+
+const NVMeDriver::NamespaceInfo NVMeDriver::INACTIVE_NAMESPACE = {0, 0, 0, 0,
+                                                                  false};
 
 NVMeDriver::DeviceIOError::DeviceIOError(const char* msg)
     : std::runtime_error(msg)
@@ -30,17 +170,36 @@ NVMeDriver::NVMeStatus NVMeDriver::AsyncCommand::wait(NVMeResult* resp)
 {
     NVMeStatus out_status;
 
-    {
-        std::unique_lock<std::mutex> lock(mutex);
+    /* The command may still sit behind a plugged doorbell. */
+    driver->flush_sq(nvmeq);
+
+    if (nvmeq->mode != CompletionMode::INTERRUPT) {
+        /* Nobody else reaps a polled queue. */
+        while (state.load(std::memory_order_acquire) != CMD_COMPLETED)
+            driver->poll_queue(nvmeq);
+    } else {
+        uint32_t expected = CMD_PENDING;
+
+        for (int i = 0; i < WAIT_SPIN_COUNT; i++) {
+            if (state.load(std::memory_order_acquire) == CMD_COMPLETED) break;
+            cpu_relax();
+        }
 
-        while (!completed)
-            cv.wait(lock);
+        if (state.compare_exchange_strong(expected, CMD_WAITING,
+                                          std::memory_order_acq_rel)) {
+            expected = CMD_WAITING;
+        }
 
-        if (resp) *resp = result;
-        out_status = status;
+        while (expected != CMD_COMPLETED) {
+            futex_wait(&state, CMD_WAITING);
+            expected = state.load(std::memory_order_acquire);
+        }
     }
 
-    driver->remove_async_command(id);
+    if (resp) *resp = result;
+    out_status = status;
+
+    driver->remove_async_command(this);
     return out_status;
 }
 
@@ -48,38 +207,218 @@ NVMeDriver::NVMeDriver(unsigned ncpus, unsigned int io_queue_depth,
                        PCIeLink* link, MemorySpace* memory_space,
                        bool use_dbbuf)
     : ncpus(ncpus), io_queue_depth(io_queue_depth), link(link),
-      memory_space(memory_space), queue_count(0), online_queues(0)
+      memory_space(memory_space), queue_count(0), online_queues(0),
+      queue_binding(QueueBinding::ROUND_ROBIN), next_bind_queue(0),
+      completion_modes(ncpus + 1, CompletionMode::INTERRUPT),
+      async_event_bufs(0), nr_async_events(0),
+      coalescing_disabled(ncpus + 1, false),
+      queue_priorities(ncpus + 1, QueuePriority::MEDIUM), use_wrr(false),
+      lazy_queues(false), arbitration(0), irq_coalesce_threshold(0),
+      irq_coalesce_time(0), max_transfer_size(DEFAULT_MAX_TRANSFER_SIZE),
+      prp_pages_per_cmd(0), overflow_limit(io_queue_depth),
+      command_timeout_ns(0),
+      hedge_percentile(0), timer_tick_ns(0), hedge_delay_ns(0),
+      queue_latency_stats(false), hedges_issued(0), hedges_won(0),
+      watchdog_stop(false),
+      instance(next_instance.fetch_add(1, std::memory_order_relaxed)),
+      ctrl_sgls(0), ctrl_oncs(0), nr_namespaces(0), use_cmb_sqs(false),
+      cmb_bar_addr(0), cmb_start(0), cmb_end(0)
 {
     if (use_dbbuf) {
-        dbbuf_dbs = memory_space->allocate(0x1000);
+        dbbuf_dbs = memory_space->allocate_pages(0x1000);
+        dbbuf_eis = memory_space->allocate_pages(0x1000);
         memory_space->memset(dbbuf_dbs, 0, 0x1000);
-        spdlog::info("Allocated doorbell buffer at {:#x}", dbbuf_dbs);
-    } else
+        memory_space->memset(dbbuf_eis, 0, 0x1000);
+        spdlog::info("Allocated doorbell buffer at {:#x}, EventIdx buffer at "
+                     "{:#x}",
+                     dbbuf_dbs, dbbuf_eis);
+    } else {
         dbbuf_dbs = 0;
+        dbbuf_eis = 0;
+    }
 
     bar4_mem.reset(link->map_bar(4));
+
+    /* Claim a slot in the per-thread context table. */
+    uint32_t slots = used_driver_slots.load(std::memory_order_relaxed);
+
+    do {
+        if (slots == (1U << MAX_DRIVERS) - 1)
+            throw std::runtime_error("Too many NVMe driver instances");
+
+        driver_slot = __builtin_ctz(~slots);
+    } while (!used_driver_slots.compare_exchange_weak(
+        slots, slots | (1U << driver_slot), std::memory_order_acq_rel));
+}
+
+NVMeDriver::~NVMeDriver()
+{
+    stop_watchdog();
+
+    used_driver_slots.fetch_and(~(1U << driver_slot),
+                                std::memory_order_release);
+}
+
+void NVMeDriver::set_max_transfer_size(size_t size)
+{
+    max_transfer_size = size;
+}
+
+void NVMeDriver::set_irq_coalescing(unsigned int threshold,
+                                    unsigned int time_100us)
+{
+    irq_coalesce_threshold = std::min(threshold, 256U);
+    irq_coalesce_time = std::min(time_100us, 255U);
+}
+
+void NVMeDriver::set_irq_coalescing_disabled(unsigned int qid, bool disabled)
+{
+    coalescing_disabled.at(qid) = disabled;
+}
+
+void NVMeDriver::set_arbitration(unsigned int high_weight,
+                                 unsigned int medium_weight,
+                                 unsigned int low_weight, unsigned int burst)
+{
+    auto weight = [](unsigned int w) {
+        /* 0's based */
+        return std::min(std::max(w, 1U), 256U) - 1;
+    };
+
+    use_wrr = true;
+    arbitration = std::min(burst, (unsigned int)NVME_ARB_BURST_NO_LIMIT)
+                      << NVME_ARB_BURST_SHIFT |
+                  weight(low_weight) << NVME_ARB_LPW_SHIFT |
+                  weight(medium_weight) << NVME_ARB_MPW_SHIFT |
+                  weight(high_weight) << NVME_ARB_HPW_SHIFT;
+}
+
+void NVMeDriver::set_queue_priority(unsigned int qid, QueuePriority prio)
+{
+    queue_priorities.at(qid) = prio;
+}
+
+void NVMeDriver::set_command_timeout(unsigned int timeout_ms)
+{
+    command_timeout_ns = timeout_ms * 1000000UL;
+}
+
+void NVMeDriver::set_read_hedging(double percentile)
+{
+    hedge_percentile = std::min(std::max(percentile, 0.0), 100.0);
+}
+
+void NVMeDriver::set_completion_mode(unsigned int qid, CompletionMode mode)
+{
+    /* The admin queue is always interrupt-driven. */
+    assert(qid > 0 && qid < completion_modes.size());
+    completion_modes[qid] = mode;
 }
 
 void NVMeDriver::set_thread_id(unsigned int thread_id)
 {
-    assert(thread_id < queues.size());
-    thread_io_queue = queues[thread_id].get();
+    size_t nr_io_queues = nr_bindable_queues();
+
+    assert(thread_id > 0 && nr_io_queues > 0);
+    thread_context().io_queue =
+        get_io_queue((thread_id - 1) % nr_io_queues + 1);
+}
+
+unsigned int NVMeDriver::bind_thread()
+{
+    unsigned int nr_io_queues = nr_bindable_queues();
+    unsigned int idx;
+
+    assert(nr_io_queues > 0);
+
+    switch (queue_binding) {
+    case QueueBinding::CPU: {
+        int cpu = sched_getcpu();
+        idx = cpu < 0 ? 0 : cpu % nr_io_queues;
+        break;
+    }
+    default:
+        idx = next_bind_queue.fetch_add(1, std::memory_order_relaxed) %
+              nr_io_queues;
+        break;
+    }
+
+    thread_context().io_queue = get_io_queue(idx + 1);
+    return idx + 1;
+}
+
+NVMeDriver::NVMeQueue* NVMeDriver::get_io_queue(unsigned int qid)
+{
+    auto* nvmeq = queues[qid].get();
+
+    if (nvmeq->online.load(std::memory_order_acquire)) return nvmeq;
+
+    std::lock_guard<std::mutex> lock(queue_create_mutex);
+
+    if (!nvmeq->online.load(std::memory_order_relaxed)) {
+        auto start = std::chrono::steady_clock::now();
+        NVMeStatus status = create_queue(nvmeq, qid);
+
+        if (status != NVME_SC_SUCCESS) {
+            spdlog::error("Failed to create NVMe queue {} status={:#x}", qid,
+                          status);
+            throw DeviceIOError("Failed to create I/O queue");
+        }
+
+        spdlog::info("Created NVMe queue {} on first use in {}us", qid,
+                     std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+    }
+
+    return nvmeq;
 }
 
 void NVMeDriver::start()
 {
+    auto start = std::chrono::steady_clock::now();
+
     link->wait_for_device_ready();
 
+    spdlog::info("Device ready in {}ms",
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count());
+
     /* IO queues + admin queue */
     for (int i = 0; i < ncpus + 1; i++)
         queues.emplace_back(std::make_unique<NVMeQueue>());
 
     link->set_irq_handler([this](uint16_t vector) {
+        if (vector >= queues.size()) return;
+
         NVMeQueue* nvmeq = queues[vector].get();
-        nvme_irq(nvmeq);
+
+        /* Polled queues are reaped by their owner thread only. */
+        if (nvmeq->mode != CompletionMode::INTERRUPT) return;
+
+        auto found = nvme_irq(nvmeq);
+
+        UNVME_TRACE_EVENT(IRQ, vector, 0, found);
+
+        nvmeq->irq_count.fetch_add(1, std::memory_order_relaxed);
+        nvmeq->irq_cqe_count.fetch_add(found, std::memory_order_relaxed);
     });
 
+    if (hedge_percentile) {
+        timer_tick_ns = HEDGE_TICK_NS;
+        read_latency_hist =
+            std::make_unique<std::atomic<uint64_t>[]>(LATENCY_BUCKETS);
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+            read_latency_hist[i].store(0, std::memory_order_relaxed);
+    } else if (command_timeout_ns) {
+        timer_tick_ns = std::min(
+            std::max(command_timeout_ns / 8, HEDGE_TICK_NS), TIMEOUT_TICK_NS);
+    }
+
     reset();
+
+    if (timer_tick_ns) start_watchdog();
 }
 
 void NVMeDriver::allocate_queue(unsigned qid, unsigned depth)
@@ -88,18 +427,107 @@ void NVMeDriver::allocate_queue(unsigned qid, unsigned depth)
 
     nvmeq->sqe_shift = qid ? NVME_NVM_IOSQES : NVME_ADM_SQES;
     nvmeq->depth = depth;
-
-    nvmeq->sq_dma_addr = memory_space->allocate_pages(SQ_SIZE(nvmeq));
+    nvmeq->mode = completion_modes[qid];
+    nvmeq->priority = queue_priorities[qid];
+    nvmeq->coalescing_disabled = coalescing_disabled[qid];
+    nvmeq->irq_count.store(0, std::memory_order_relaxed);
+    nvmeq->irq_cqe_count.store(0, std::memory_order_relaxed);
+    nvmeq->online.store(false, std::memory_order_relaxed);
+    nvmeq->submitted.store(0, std::memory_order_relaxed);
+    nvmeq->in_flight_sum.store(0, std::memory_order_relaxed);
+    nvmeq->max_in_flight.store(0, std::memory_order_relaxed);
+    nvmeq->sq_doorbells.store(0, std::memory_order_relaxed);
+    nvmeq->sq_mmio_writes.store(0, std::memory_order_relaxed);
+    nvmeq->prp_list_pooled.store(0, std::memory_order_relaxed);
+    nvmeq->prp_list_allocs.store(0, std::memory_order_relaxed);
+    nvmeq->completed.store(0, std::memory_order_relaxed);
+    nvmeq->latency_sum_ns.store(0, std::memory_order_relaxed);
+    nvmeq->hybrid_armed.store(false, std::memory_order_relaxed);
+    nvmeq->cq_busy.store(false, std::memory_order_relaxed);
+    nvmeq->mean_service_ns.store(0, std::memory_order_relaxed);
+
+    nvmeq->sq_in_cmb = qid && cmb_bar_addr && allocate_cmb_sq(nvmeq.get(), qid);
+    if (!nvmeq->sq_in_cmb)
+        nvmeq->sq_dma_addr = memory_space->allocate_pages(SQ_SIZE(nvmeq));
     nvmeq->cq_dma_addr = memory_space->allocate_pages(CQ_SIZE(nvmeq));
 
+    auto* sq_space = nvmeq->sq_in_cmb ? bar4_mem.get() : memory_space;
+    size_t sq_size = SQ_SIZE(nvmeq), cq_size = CQ_SIZE(nvmeq);
+    nvmeq->sq_cmds = static_cast<struct nvme_command*>(
+        sq_space->get_raw_ptr(nvmeq->sq_dma_addr, sq_size));
+    nvmeq->cqes = static_cast<struct nvme_completion*>(
+        memory_space->get_raw_ptr(nvmeq->cq_dma_addr, cq_size));
+    assert(nvmeq->sq_cmds && sq_size == SQ_SIZE(nvmeq));
+    assert(nvmeq->cqes && cq_size == CQ_SIZE(nvmeq));
+
+    nvmeq->prp_pool = 0;
+    nvmeq->prp_pool_ptr = nullptr;
+
+    if (qid && prp_pages_per_cmd) {
+        size_t pool_size = (size_t)depth * prp_pages_per_cmd * ctrl_page_size;
+
+        try {
+            nvmeq->prp_pool = memory_space->allocate_pages(pool_size);
+            nvmeq->prp_pool_ptr = static_cast<uint8_t*>(
+                memory_space->get_raw_ptr(nvmeq->prp_pool, pool_size));
+        } catch (MemorySpace::MemoryNotAvailable&) {
+            spdlog::warn("Cannot allocate PRP list pool for NVMe queue {}, "
+                         "falling back to per-command allocation",
+                         qid);
+        }
+    }
+
+    nvmeq->latency_hist.reset();
+    if (qid && queue_latency_stats) {
+        nvmeq->latency_hist =
+            std::make_unique<std::atomic<uint64_t>[]>(LATENCY_BUCKETS);
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+            nvmeq->latency_hist[i].store(0, std::memory_order_relaxed);
+    }
+
+    if (timer_tick_ns) {
+        nvmeq->timers = std::make_unique<TimerEntry[]>(TIMER_WHEEL_SLOTS);
+        for (unsigned int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            auto* head = &nvmeq->timers[i];
+
+            head->prev = head->next = head;
+        }
+
+        nvmeq->deadlines = std::make_unique<TimerEntry[]>(depth);
+        for (unsigned int i = 0; i < depth; i++)
+            nvmeq->deadlines[i].prev = nvmeq->deadlines[i].next = nullptr;
+
+        nvmeq->timer_tick = now_ns() / timer_tick_ns;
+    }
+
+    nvmeq->overflow.clear();
+    nvmeq->overflow.resize(overflow_limit);
+
+    nvmeq->commands = std::make_unique<AsyncCommand[]>(depth);
+    nvmeq->reaped.reserve(depth);
+    nvmeq->batched = std::make_unique<BatchCompletion[]>(depth);
+    for (unsigned int i = 0; i < depth; i++) {
+        auto& cmd = nvmeq->commands[i];
+
+        cmd.driver = this;
+        cmd.nvmeq = nvmeq.get();
+        cmd.id = i;
+        cmd.context = nullptr;
+        cmd.gen.store(0, std::memory_order_relaxed);
+        cmd.next_free.store(i + 1, std::memory_order_relaxed);
+    }
+    nvmeq->free_commands.store(0, std::memory_order_release);
+
     nvmeq->qid = qid;
     nvmeq->q_db = NVME_REG_DBS + qid * 8 * db_stride;
     nvmeq->cq_phase = 1;
     nvmeq->cq_head = 0;
     queue_count++;
 
-    spdlog::info("Allocate NVMe queue {} sq_addr={:#x} cq_addr={:#x} depth={}",
-                 qid, nvmeq->sq_dma_addr, nvmeq->cq_dma_addr, depth);
+    spdlog::info("Allocate NVMe queue {} sq_addr={:#x}{} cq_addr={:#x} "
+                 "depth={} prp_pool={:#x}",
+                 qid, nvmeq->sq_dma_addr, nvmeq->sq_in_cmb ? " (CMB)" : "",
+                 nvmeq->cq_dma_addr, depth, nvmeq->prp_pool);
 }
 
 void NVMeDriver::init_queue(unsigned qid)
@@ -108,21 +536,45 @@ void NVMeDriver::init_queue(unsigned qid)
 
     nvmeq->sq_tail = 0;
     nvmeq->last_sq_tail = 0;
+    nvmeq->sq_head.store(0, std::memory_order_relaxed);
+    nvmeq->overflow_head = 0;
+    nvmeq->overflow_count.store(0, std::memory_order_relaxed);
     nvmeq->cq_head = 0;
     nvmeq->q_db = NVME_REG_DBS + qid * 8 * db_stride;
     nvmeq->cq_phase = 1;
 
     if (dbbuf_dbs && qid) {
-        nvmeq->dbbuf_sq_db = dbbuf_dbs + qid * 8 * db_stride;
-        nvmeq->dbbuf_cq_db = dbbuf_dbs + qid * 8 * db_stride + 4 * db_stride;
+        size_t sq_off = qid * 8 * db_stride;
+        size_t cq_off = sq_off + 4 * db_stride;
+
+        nvmeq->dbbuf_sq_db = dbbuf_ptr(dbbuf_dbs + sq_off);
+        nvmeq->dbbuf_cq_db = dbbuf_ptr(dbbuf_dbs + cq_off);
+        nvmeq->dbbuf_sq_ei = dbbuf_ptr(dbbuf_eis + sq_off);
+        nvmeq->dbbuf_cq_ei = dbbuf_ptr(dbbuf_eis + cq_off);
     }
 
     memory_space->memset(nvmeq->cq_dma_addr, 0, CQ_SIZE(nvmeq));
     online_queues++;
+    nvmeq->online.store(true, std::memory_order_release);
+}
+
+static inline unsigned long elapsed_ms(
+    std::chrono::steady_clock::time_point& since)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now - since);
+
+    since = now;
+    return ms.count();
 }
 
 void NVMeDriver::reset()
 {
+    auto start = std::chrono::steady_clock::now();
+    auto phase = start;
+    unsigned long admin_ms, identify_ms, io_queues_ms;
+
     ctrl_cap = link->readq(NVME_REG_CAP);
 
     queue_depth = std::min((int)(NVME_CAP_MQES(ctrl_cap) + 1), io_queue_depth);
@@ -132,14 +584,34 @@ void NVMeDriver::reset()
                  db_stride);
 
     setup_admin_queue();
+    admin_ms = elapsed_ms(phase);
 
     identify_controller();
+    identify_ms = elapsed_ms(phase);
 
     setup_io_queues();
 
     if (dbbuf_dbs) {
         dbbuf_config();
     }
+    io_queues_ms = elapsed_ms(phase);
+
+    config_async_events();
+
+    spdlog::info("Controller bring-up: admin queue {}ms, identify {}ms, {} of "
+                 "{} I/O queues {}ms, total {}ms",
+                 admin_ms, identify_ms, online_queues - 1, queue_count - 1,
+                 io_queues_ms, elapsed_ms(start));
+}
+
+uint32_t* NVMeDriver::dbbuf_ptr(MemorySpace::Address addr)
+{
+    size_t len = sizeof(uint32_t);
+    auto* ptr = memory_space->get_raw_ptr(addr, len);
+
+    assert(ptr && len == sizeof(uint32_t));
+
+    return static_cast<uint32_t*>(ptr);
 }
 
 void NVMeDriver::check_status(int status)
@@ -157,8 +629,16 @@ void NVMeDriver::check_status(int status)
 void NVMeDriver::wait_ready(bool enabled)
 {
     uint32_t csts, bit = enabled ? NVME_CSTS_RDY : 0;
-
-    while (true) {
+    /* CAP.TO is in 500ms units. */
+    auto deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(
+            std::max<uint64_t>(NVME_CAP_TIMEOUT(ctrl_cap), 1) * 500);
+    uint64_t delay_us = CSTS_MIN_DELAY_US;
+
+    /* Every CSTS read may be a round trip over the link, so back off
+     * once the controller does not turn ready right away. */
+    for (unsigned int i = 0;; i++) {
         csts = link->readl(NVME_REG_CSTS);
 
         if (csts == ~0) {
@@ -166,6 +646,14 @@ void NVMeDriver::wait_ready(bool enabled)
         }
 
         if ((csts & NVME_CSTS_RDY) == bit) break;
+
+        if (std::chrono::steady_clock::now() > deadline)
+            throw DeviceIOError("Timed out waiting for controller ready");
+
+        if (i < CSTS_SPIN_COUNT) continue;
+
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        delay_us = std::min(delay_us * 2, CSTS_MAX_DELAY_US);
     }
 }
 
@@ -181,6 +669,13 @@ void NVMeDriver::disable_controller()
 
 void NVMeDriver::shutdown()
 {
+    stop_watchdog();
+
+    if (hedge_percentile)
+        spdlog::info("Hedged reads issued={} won={}",
+                     hedges_issued.load(std::memory_order_relaxed),
+                     hedges_won.load(std::memory_order_relaxed));
+
     ctrl_config &= ~NVME_CC_SHN_MASK;
     ctrl_config |= NVME_CC_SHN_NORMAL;
 
@@ -202,7 +697,14 @@ void NVMeDriver::enable_controller()
 
     ctrl_config = NVME_CC_CSS_NVM;
     ctrl_config |= (page_shift - 12) << NVME_CC_MPS_SHIFT;
-    ctrl_config |= NVME_CC_AMS_RR | NVME_CC_SHN_NONE;
+    if (use_wrr && !(NVME_CAP_AMS(ctrl_cap) & NVME_CAP_AMS_WRRU)) {
+        spdlog::warn("Controller does not support weighted round robin "
+                     "arbitration, using round robin");
+        use_wrr = false;
+    }
+
+    ctrl_config |= use_wrr ? NVME_CC_AMS_WRRU : NVME_CC_AMS_RR;
+    ctrl_config |= NVME_CC_SHN_NONE;
     ctrl_config |= NVME_CC_IOSQES | NVME_CC_IOCQES;
     ctrl_config |= NVME_CC_ENABLE;
 
@@ -211,429 +713,2384 @@ void NVMeDriver::enable_controller()
     wait_ready(true);
 }
 
-NVMeDriver::AsyncCommand*
-NVMeDriver::setup_async_command(AsyncCommandCallback&& callback)
-{
-    std::lock_guard<std::mutex> guard(command_mutex);
-    auto id = command_id_counter.fetch_add(1);
+NVMeDriver::AsyncCommand* NVMeDriver::alloc_async_command(NVMeQueue* nvmeq)
+{
+    uint64_t head = nvmeq->free_commands.load(std::memory_order_acquire);
+    AsyncCommand* cmd;
+
+    for (;;) {
+        uint32_t idx = head & 0xffffffff;
+
+        if (idx >= nvmeq->depth) return nullptr;
+
+        cmd = &nvmeq->commands[idx];
+        uint64_t next = ((head >> 32) + 1) << 32 |
+                        cmd->next_free.load(std::memory_order_relaxed);
+
+        if (nvmeq->free_commands.compare_exchange_weak(
+                head, next, std::memory_order_acq_rel,
+                std::memory_order_acquire))
+            break;
+    }
+
+    cmd->state.store(AsyncCommand::CMD_PENDING, std::memory_order_relaxed);
+
+    return cmd;
+}
+
+void NVMeDriver::remove_async_command(AsyncCommand* cmd)
+{
+    auto* nvmeq = cmd->nvmeq;
+
+    for (auto&& prp : cmd->prp_lists)
+        memory_space->free(prp, 0x1000);
+    cmd->prp_lists.clear();
+    cmd->callback = nullptr;
+    cmd->context = nullptr;
+    cmd->gen.fetch_add(1, std::memory_order_release);
+
+    uint64_t head = nvmeq->free_commands.load(std::memory_order_relaxed);
+    uint64_t next;
+
+    do {
+        cmd->next_free.store(head & 0xffffffff, std::memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | cmd->id;
+    } while (!nvmeq->free_commands.compare_exchange_weak(
+        head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void* NVMeDriver::get_list_page(AsyncCommand* acmd, size_t idx, bool pooled,
+                                MemorySpace::Address& addr)
+{
+    if (pooled) {
+        auto* nvmeq = acmd->nvmeq;
+        size_t offset =
+            ((size_t)acmd->id * prp_pages_per_cmd + idx) * ctrl_page_size;
+
+        nvmeq->prp_list_pooled.fetch_add(1, std::memory_order_relaxed);
+        addr = nvmeq->prp_pool + offset;
+        return nvmeq->prp_pool_ptr + offset;
+    }
+
+    size_t len = ctrl_page_size;
+    addr = memory_space->allocate_pages(ctrl_page_size);
+    acmd->prp_lists.push_back(addr);
+    acmd->nvmeq->prp_list_allocs.fetch_add(1, std::memory_order_relaxed);
+
+    auto* ptr = memory_space->get_raw_ptr(addr, len);
+    assert(ptr && len == ctrl_page_size);
+
+    return ptr;
+}
+
+bool NVMeDriver::sgl_usable(NVMeQueue* nvmeq, MemorySpace::Address buf,
+                            size_t buflen) const
+{
+    /* Admin commands always use PRPs. */
+    if (!nvmeq->qid || buflen > UINT32_MAX) return false;
+
+    switch (ctrl_sgls & NVME_CTRL_SGLS_MASK) {
+    case NVME_CTRL_SGLS_BYTE_ALIGNED:
+        return true;
+    case NVME_CTRL_SGLS_DWORD_ALIGNED:
+        return !(buf & 3) && !(buflen & 3);
+    default:
+        return false;
+    }
+}
+
+bool NVMeDriver::sgl_usable(NVMeQueue* nvmeq,
+                            const struct nvme_sgl_desc* descs,
+                            size_t ndescs) const
+{
+    for (size_t i = 0; i < ndescs; i++) {
+        if (!sgl_usable(nvmeq, endian::little_to_native(descs[i].addr),
+                        endian::little_to_native(descs[i].length)))
+            return false;
+    }
+
+    return true;
+}
+
+void NVMeDriver::setup_buffer(AsyncCommand* acmd, struct nvme_command* cmd,
+                              MemorySpace::Address buf, size_t buflen)
+{
+    auto offset = buf % ctrl_page_size;
+
+    if (offset + buflen <= ctrl_page_size * 2) {
+        auto first_prp_len = ctrl_page_size - offset;
+
+        cmd->common.dptr.prp1 = endian::native_to_little(buf);
+        if (buflen > first_prp_len)
+            cmd->common.dptr.prp2 =
+                endian::native_to_little(buf + first_prp_len);
+
+        return;
+    }
+
+    /* A contiguous buffer is described by a single SGL data block in the
+     * command itself, which saves building a PRP list. */
+    if (sgl_usable(acmd->nvmeq, buf, buflen)) {
+        struct nvme_sgl_desc sge;
+
+        memset(&sge, 0, sizeof(sge));
+        sgl_set_data(&sge, buf, buflen);
+        setup_sgl(acmd, cmd, &sge, 1);
+
+        return;
+    }
+
+    struct nvme_sgl_desc desc;
+
+    memset(&desc, 0, sizeof(desc));
+    sgl_set_data(&desc, buf, buflen);
+    setup_prps(acmd, cmd, &desc, 1);
+}
+
+void NVMeDriver::setup_prps(AsyncCommand* acmd, struct nvme_command* cmd,
+                            const struct nvme_sgl_desc* descs, size_t ndescs)
+{
+    uint64_t page_mask = ctrl_page_size - 1;
+    size_t entries_per_page = ctrl_page_size >> 3;
+    size_t nprps = 0;
+
+    for (size_t i = 0; i < ndescs; i++) {
+        uint64_t addr = endian::little_to_native(descs[i].addr);
+        uint32_t len = endian::little_to_native(descs[i].length);
+
+        nprps += ((addr & page_mask) + len + page_mask) / ctrl_page_size;
+    }
+
+    /* Walks the pages of the data blocks in order. */
+    size_t desc = 0;
+    uint64_t next = endian::little_to_native(descs[0].addr);
+    auto next_prp = [&]() {
+        uint64_t prp = next;
+        uint64_t end = endian::little_to_native(descs[desc].addr) +
+                       endian::little_to_native(descs[desc].length);
+
+        next = (prp & ~page_mask) + ctrl_page_size;
+        if (next >= end && ++desc < ndescs)
+            next = endian::little_to_native(descs[desc].addr);
+
+        return prp;
+    };
+
+    cmd->common.dptr.prp1 = endian::native_to_little(next_prp());
+
+    if (nprps == 1) return;
+    if (nprps == 2) {
+        cmd->common.dptr.prp2 = endian::native_to_little(next_prp());
+        return;
+    }
+
+    /* Every list page but the last gives up its final entry to chain to the
+     * next page. */
+    nprps--;
+    size_t npages = nprps <= entries_per_page
+                        ? 1
+                        : (nprps - 2) / (entries_per_page - 1) + 1;
+    bool pooled = acmd->nvmeq->prp_pool_ptr && npages <= prp_pages_per_cmd;
+
+    uint64_t* prp_list;
+    MemorySpace::Address list_addr;
+    size_t i = 0, page = 0;
+
+    prp_list = static_cast<uint64_t*>(
+        get_list_page(acmd, page, pooled, list_addr));
+    cmd->common.dptr.prp2 = endian::native_to_little((uint64_t)list_addr);
+
+    for (;;) {
+        if (i == entries_per_page - 1 && nprps > 1) {
+            auto* next_list = static_cast<uint64_t*>(
+                get_list_page(acmd, ++page, pooled, list_addr));
+
+            prp_list[i] = endian::native_to_little((uint64_t)list_addr);
+            prp_list = next_list;
+            i = 0;
+        }
+
+        prp_list[i++] = endian::native_to_little(next_prp());
+
+        if (--nprps == 0) break;
+    }
+}
+
+void NVMeDriver::setup_sgl(AsyncCommand* acmd, struct nvme_command* cmd,
+                           const struct nvme_sgl_desc* descs, size_t ndescs)
+{
+    size_t entries_per_page = ctrl_page_size / sizeof(struct nvme_sgl_desc);
+
+    cmd->common.flags |= NVME_CMD_SGL_METABUF;
+
+    if (ndescs == 1) {
+        cmd->common.dptr.sgl = descs[0];
+        return;
+    }
+
+    /* Descriptors that do not fit in the command go to segments in list
+     * pages. Every segment but the last gives up its final entry to chain to
+     * the next one. */
+    size_t npages = ndescs <= entries_per_page
+                        ? 1
+                        : (ndescs - 2) / (entries_per_page - 1) + 1;
+    bool pooled = acmd->nvmeq->prp_pool_ptr && npages <= prp_pages_per_cmd;
+
+    struct nvme_sgl_desc* seg = &cmd->common.dptr.sgl;
+    MemorySpace::Address list_addr;
+    size_t page = 0;
+
+    for (;;) {
+        auto* list = static_cast<struct nvme_sgl_desc*>(
+            get_list_page(acmd, page++, pooled, list_addr));
+        bool last = ndescs <= entries_per_page;
+        size_t n = last ? ndescs : entries_per_page - 1;
+
+        sgl_set_seg(seg, list_addr, last ? n : entries_per_page, last);
+        memcpy(list, descs, n * sizeof(*descs));
+
+        if (last) break;
+
+        descs += n;
+        ndescs -= n;
+        seg = &list[n];
+    }
+}
+
+void NVMeDriver::write_sq_doorbell(NVMeQueue* nvmeq, bool write_sq)
+{
+    uint32_t tail;
+    bool mmio;
+
+    if (!write_sq) {
+        uint16_t next_tail = nvmeq->sq_tail + 1;
+
+        if (next_tail == nvmeq->depth) next_tail = 0;
+        if (next_tail != nvmeq->last_sq_tail) return;
+    }
+
+    tail = nvmeq->sq_tail;
+    counter_add(nvmeq->sq_doorbells, 1);
+
+    mmio = !nvmeq->dbbuf_sq_db ||
+           dbbuf_update_and_check_event(tail, nvmeq->dbbuf_sq_db,
+                                        nvmeq->dbbuf_sq_ei);
+    if (mmio) {
+        link->writel(nvmeq->q_db, tail);
+        counter_add(nvmeq->sq_mmio_writes, 1);
+    }
+
+    UNVME_TRACE_EVENT(SQ_DOORBELL, nvmeq->qid, 0, tail, mmio);
+
+    nvmeq->last_sq_tail = nvmeq->sq_tail;
+}
+
+void NVMeDriver::flush_sq(NVMeQueue* nvmeq)
+{
+    std::lock_guard<std::mutex> lock(nvmeq->mutex);
+
+    if (nvmeq->sq_tail != nvmeq->last_sq_tail) write_sq_doorbell(nvmeq, true);
+}
+
+void NVMeDriver::unplug()
+{
+    auto& ctx = thread_context();
+
+    assert(ctx.plug_depth > 0);
+
+    if (--ctx.plug_depth == 0 && ctx.io_queue) flush_sq(ctx.io_queue);
+}
+
+void NVMeDriver::ring_cq_doorbell(NVMeQueue* nvmeq)
+{
+    uint32_t head = nvmeq->cq_head;
+
+    UNVME_TRACE_EVENT(CQ_DOORBELL, nvmeq->qid, 0, head);
+
+    if (!nvmeq->dbbuf_cq_db ||
+        dbbuf_update_and_check_event(head, nvmeq->dbbuf_cq_db,
+                                     nvmeq->dbbuf_cq_ei))
+        link->writel(nvmeq->q_db + 4 * db_stride, head);
+}
+
+bool NVMeDriver::submit_sq_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                                   bool write_sq)
+{
+    std::lock_guard<std::mutex> lock(nvmeq->mutex);
+    uint16_t next_tail = nvmeq->sq_tail + 1;
+
+    if (next_tail == nvmeq->depth) next_tail = 0;
+    /* Full until the controller reports consumed entries through sq_head. */
+    if (next_tail == nvmeq->sq_head.load(std::memory_order_acquire))
+        return false;
+
+    if (nvmeq->sq_in_cmb)
+        BARMemorySpace::write_command(&nvmeq->sq_cmds[nvmeq->sq_tail], cmd);
+    else
+        memcpy(&nvmeq->sq_cmds[nvmeq->sq_tail], cmd, sizeof(*cmd));
+    UNVME_TRACE_EVENT(SUBMIT, nvmeq->qid, cmd->common.command_id,
+                      cmd->common.opcode,
+                      endian::little_to_native(cmd->common.nsid));
+    /* The entry must be visible before the doorbell write. */
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t submitted = nvmeq->submitted.load(std::memory_order_relaxed) + 1;
+    uint64_t in_flight =
+        submitted - nvmeq->completed.load(std::memory_order_relaxed);
+
+    nvmeq->submitted.store(submitted, std::memory_order_relaxed);
+    counter_add(nvmeq->in_flight_sum, in_flight);
+    if (in_flight > nvmeq->max_in_flight.load(std::memory_order_relaxed))
+        nvmeq->max_in_flight.store(in_flight, std::memory_order_relaxed);
+
+    nvmeq->sq_tail = next_tail;
+    write_sq_doorbell(nvmeq, write_sq);
+
+    return true;
+}
+
+NVMeDriver::AsyncCommand*
+NVMeDriver::try_submit_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                               MemorySpace::Address buf, size_t buflen,
+                               const struct nvme_sgl_desc* descs,
+                               size_t ndescs, AsyncCommandCallback& callback,
+                               void* context, bool write_sq,
+                               HedgedRead* hedge)
+{
+    auto* acmd = alloc_async_command(nvmeq);
+
+    if (!acmd) return nullptr;
+
+    cmd->common.command_id = acmd->id;
+
+    try {
+        /* Data blocks the controller cannot take as an SGL are ones that
+         * PRPs can describe. */
+        if (ndescs && sgl_usable(nvmeq, descs, ndescs))
+            setup_sgl(acmd, cmd, descs, ndescs);
+        else if (ndescs)
+            setup_prps(acmd, cmd, descs, ndescs);
+        else if (buflen)
+            setup_buffer(acmd, cmd, buf, buflen);
+    } catch (MemorySpace::MemoryNotAvailable&) {
+        remove_async_command(acmd);
+        throw;
+    }
+
+    /* The command may complete as soon as it is in the SQ. */
+    acmd->callback = std::move(callback);
+    acmd->context = context;
+    acmd->opcode = cmd->common.opcode;
+
+    if (nvmeq->mode == CompletionMode::HYBRID || hedge_percentile ||
+        nvmeq->latency_hist)
+        acmd->submit_time = now_ns();
+
+    if (nvmeq->mode == CompletionMode::HYBRID)
+        nvmeq->hybrid_armed.store(true, std::memory_order_relaxed);
+
+    /* Read before the command is in the SQ: it may complete and the slot
+     * may be reused right after. */
+    uint32_t gen = acmd->gen.load(std::memory_order_relaxed);
+    uint16_t id = acmd->id;
+
+    if (!submit_sq_command(nvmeq, cmd, write_sq)) {
+        callback = std::move(acmd->callback);
+        remove_async_command(acmd);
+        return nullptr;
+    }
+
+    /* Asynchronous event requests stay outstanding indefinitely. A command
+     * that has completed meanwhile leaves a stale entry, which is dropped
+     * on expiry or rearmed by the next command in the slot. */
+    if (command_timeout_ns &&
+        !(nvmeq->qid == 0 && (cmd->common.opcode == nvme_admin_async_event ||
+                              cmd->common.opcode == nvme_admin_abort_cmd)))
+        arm_timer(nvmeq, &nvmeq->deadlines[id], {0, nullptr, gen, id, false},
+                  command_timeout_ns);
+
+    if (hedge) {
+        hedge->cid = id;
+        hedge->gen = gen;
+        arm_timer(nvmeq, &hedge->timer, {0, hedge, gen, id, false},
+                  hedge_delay_ns.load(std::memory_order_relaxed));
+    }
+
+    return acmd;
+}
+
+NVMeDriver::AsyncCommand*
+NVMeDriver::submit_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                           MemorySpace::Address buf, size_t buflen,
+                           const struct nvme_sgl_desc* descs, size_t ndescs,
+                           AsyncCommandCallback&& callback, void* context,
+                           bool nowait, HedgedRead* hedge)
+{
+    auto& ctx = thread_context();
+    bool write_sq = !ctx.plug_depth || nvmeq != ctx.io_queue;
+    AsyncCommand* acmd;
+
+    if (nowait) {
+        /* Do not overtake queued commands. */
+        if (nvmeq->overflow_count.load(std::memory_order_acquire))
+            return nullptr;
+
+        return try_submit_command(nvmeq, cmd, buf, buflen, descs, ndescs,
+                                  callback, context, write_sq, hedge);
+    }
+
+    if (!callback && !context) {
+        /* Synchronous callers wait for room. */
+        while (!(acmd = try_submit_command(nvmeq, cmd, buf, buflen, descs,
+                                           ndescs, callback, nullptr,
+                                           write_sq))) {
+            flush_sq(nvmeq);
+
+            if (nvmeq->mode != CompletionMode::INTERRUPT)
+                poll_queue(nvmeq);
+            else
+                std::this_thread::yield();
+        }
+
+        return acmd;
+    }
+
+    for (;;) {
+        if (!nvmeq->overflow_count.load(std::memory_order_acquire)) {
+            acmd = try_submit_command(nvmeq, cmd, buf, buflen, descs, ndescs,
+                                      callback, context, write_sq, hedge);
+            if (acmd) return acmd;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(nvmeq->overflow_mutex);
+
+            /* Callbacks run while the queue is being reaped and would wait
+             * for themselves, so they may exceed the limit. */
+            if (nvmeq->overflow_count.load(std::memory_order_relaxed) <
+                    nvmeq->overflow.size() ||
+                ctx.callback_depth) {
+                push_overflow_locked(nvmeq, cmd, buf, buflen, descs, ndescs,
+                                     std::move(callback), context);
+
+                /* Completions may have made room before the command was
+                 * queued. */
+                drain_overflow_locked(nvmeq);
+
+                return nullptr;
+            }
+        }
+
+        /* The overflow queue is full: wait for completions. */
+        flush_sq(nvmeq);
+
+        if (nvmeq->mode != CompletionMode::INTERRUPT)
+            poll_queue(nvmeq);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void NVMeDriver::push_overflow_locked(NVMeQueue* nvmeq,
+                                      struct nvme_command* cmd,
+                                      MemorySpace::Address buf, size_t buflen,
+                                      const struct nvme_sgl_desc* descs,
+                                      size_t ndescs,
+                                      AsyncCommandCallback&& callback,
+                                      void* context)
+{
+    auto& ring = nvmeq->overflow;
+    size_t count = nvmeq->overflow_count.load(std::memory_order_relaxed);
+
+    if (count == ring.size()) {
+        /* Unroll the ring so that the new slots follow its tail. */
+        std::rotate(ring.begin(), ring.begin() + nvmeq->overflow_head,
+                    ring.end());
+        nvmeq->overflow_head = 0;
+        ring.resize(std::max<size_t>(2 * ring.size(), 1));
+    }
+
+    auto& pending = ring[(nvmeq->overflow_head + count) % ring.size()];
+
+    pending.cmd = *cmd;
+    pending.buf = buf;
+    pending.buflen = buflen;
+    pending.sgl.assign(descs, descs + ndescs);
+    pending.callback = std::move(callback);
+    pending.context = context;
+
+    nvmeq->overflow_count.fetch_add(1, std::memory_order_release);
+}
+
+void NVMeDriver::drain_overflow_locked(NVMeQueue* nvmeq)
+{
+    auto& ring = nvmeq->overflow;
+
+    while (nvmeq->overflow_count.load(std::memory_order_relaxed)) {
+        auto& pending = ring[nvmeq->overflow_head];
+
+        if (!try_submit_command(nvmeq, &pending.cmd, pending.buf,
+                                pending.buflen, pending.sgl.data(),
+                                pending.sgl.size(), pending.callback,
+                                pending.context, true))
+            break;
+
+        pending.callback = nullptr;
+        nvmeq->overflow_head = (nvmeq->overflow_head + 1) % ring.size();
+        nvmeq->overflow_count.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void NVMeDriver::drain_overflow(NVMeQueue* nvmeq)
+{
+    std::lock_guard<std::mutex> lock(nvmeq->overflow_mutex);
+
+    drain_overflow_locked(nvmeq);
+}
+
+NVMeDriver::NVMeStatus
+NVMeDriver::submit_sync_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
+                                MemorySpace::Address buf, size_t buflen,
+                                union nvme_completion::nvme_result* result)
+{
+    auto* acmd =
+        submit_command(nvmeq, cmd, buf, buflen, nullptr, 0, {}, nullptr);
+
+    return acmd->wait(result);
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::nvme_features(uint8_t op, unsigned int fid,
+                                                 unsigned int dword11,
+                                                 uint32_t* result)
+{
+    struct nvme_command c;
+    union nvme_completion::nvme_result res = {0};
+    NVMeStatus status;
+
+    memset(&c, 0, sizeof(c));
+    c.features.opcode = op;
+    c.features.fid = endian::native_to_little(fid);
+    c.features.dword11 = endian::native_to_little(dword11);
+
+    status = submit_sync_command(queues[0].get(), &c, 0, 0, &res);
+
+    if (result) *result = endian::little_to_native(res.u32);
+    return status;
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::set_queue_count(int& count)
+{
+    uint32_t result;
+    uint32_t q_count = (count - 1) | ((count - 1) << 16);
+    int nioqs;
+    NVMeDriver::NVMeStatus status;
+
+    status = set_features(NVME_FEAT_NUM_QUEUES, q_count, &result);
+
+    if (status > 0)
+        count = 0;
+    else {
+        nioqs = std::min(result & 0xffff, result >> 16) + 1;
+        count = std::min(count, nioqs);
+    }
+
+    return NVME_SC_SUCCESS;
+}
+
+void NVMeDriver::config_irq_coalescing()
+{
+    NVMeStatus status;
+    uint32_t dword11;
+
+    if (!irq_coalesce_threshold && !irq_coalesce_time) return;
+
+    /* The aggregation threshold is 0's based. */
+    dword11 = (std::max(irq_coalesce_threshold, 1U) - 1)
+                  << NVME_IRQ_COALESCE_THR_SHIFT |
+              irq_coalesce_time << NVME_IRQ_COALESCE_TIME_SHIFT;
+
+    status = set_features(NVME_FEAT_IRQ_COALESCE, dword11, nullptr);
+    if (status != NVME_SC_SUCCESS) {
+        spdlog::warn("Failed to set interrupt coalescing status={:#x}", status);
+        return;
+    }
+
+    spdlog::info("Interrupt coalescing threshold={} time={}us",
+                 std::max(irq_coalesce_threshold, 1U), irq_coalesce_time * 100);
+}
+
+void NVMeDriver::config_arbitration()
+{
+    NVMeStatus status;
+
+    if (!use_wrr) return;
+
+    status = set_features(NVME_FEAT_ARBITRATION, arbitration, nullptr);
+    if (status != NVME_SC_SUCCESS) {
+        spdlog::warn("Failed to set arbitration weights status={:#x}", status);
+        return;
+    }
+
+    spdlog::info("Weighted round robin arbitration arbitration={:#x}",
+                 arbitration);
+}
+
+void NVMeDriver::config_async_events()
+{
+    NVMeStatus status;
+
+    status = set_features(NVME_FEAT_ASYNC_EVENT,
+                          NVME_AEN_CFG_SMART_MASK | NVME_AEN_CFG_NS_ATTR,
+                          nullptr);
+    if (status != NVME_SC_SUCCESS)
+        spdlog::warn("Failed to configure asynchronous events status={:#x}",
+                     status);
+
+    /* AERL is 0's based. Each request holds an admin queue slot. */
+    nr_async_events =
+        id_ctrl ? std::min(id_ctrl->aerl + 1U, MAX_ASYNC_EVENTS) : 1;
+
+    if (!async_event_bufs)
+        async_event_bufs = memory_space->allocate_pages(
+            nr_async_events * ASYNC_EVENT_LOG_SIZE);
+
+    for (unsigned int i = 0; i < nr_async_events; i++)
+        submit_async_event(i);
+
+    spdlog::info("Posted {} asynchronous event requests", nr_async_events);
+}
+
+void NVMeDriver::submit_async_event(unsigned int slot)
+{
+    struct nvme_command c;
+
+    memset(&c, 0, sizeof(c));
+    c.common.opcode = nvme_admin_async_event;
+
+    (void)submit_async_command(
+        queues[0].get(), &c, 0, 0,
+        [this, slot](NVMeStatus status, const NVMeResult& result) {
+            handle_async_event(slot, status, result);
+        });
+}
+
+void NVMeDriver::handle_async_event(unsigned int slot, NVMeStatus status,
+                                    const NVMeResult& result)
+{
+    struct nvme_command c;
+    AsyncEvent event;
+    uint32_t dw0;
+    size_t size;
+
+    switch (status & 0x7ff) {
+    case NVME_SC_SUCCESS:
+        break;
+    case NVME_SC_ABORT_REQ:
+    case NVME_SC_ABORT_QUEUE:
+        /* Controller reset or shutdown. */
+        return;
+    default:
+        spdlog::warn("Asynchronous event request failed status={:#x}",
+                     status);
+        return;
+    }
+
+    dw0 = endian::little_to_native(result.u32);
+    event.type = dw0 & 0x7;
+    event.info = (dw0 >> 8) & 0xff;
+    event.log_page = (dw0 >> 16) & 0xff;
+
+    spdlog::info("Asynchronous event type={} info={:#x} log_page={:#x}",
+                 event.type, event.info, event.log_page);
+
+    if (!event.log_page) {
+        complete_async_event(slot, event, NVME_SC_SUCCESS);
+        return;
+    }
+
+    /* The event type stays masked until its log page is read. */
+    size = event.log_page == NVME_LOG_CHANGED_NS ? ASYNC_EVENT_LOG_SIZE
+                                                 : sizeof(nvme_smart_log);
+
+    memset(&c, 0, sizeof(c));
+    c.get_log_page.opcode = nvme_admin_get_log_page;
+    c.get_log_page.nsid = endian::native_to_little(NVME_NSID_ALL);
+    c.get_log_page.lid = event.log_page;
+    c.get_log_page.numdl = endian::native_to_little((uint16_t)(size / 4 - 1));
+
+    (void)submit_async_command(
+        queues[0].get(), &c, async_event_bufs + slot * ASYNC_EVENT_LOG_SIZE,
+        size, [this, slot, event](NVMeStatus status, const NVMeResult&) {
+            complete_async_event(slot, event, status);
+        });
+}
+
+void NVMeDriver::complete_async_event(unsigned int slot,
+                                      const AsyncEvent& event,
+                                      NVMeStatus status)
+{
+    if (status != NVME_SC_SUCCESS)
+        spdlog::warn("Failed to read log page {:#x} of asynchronous event "
+                     "status={:#x}",
+                     event.log_page, status);
+
+    if (status == NVME_SC_SUCCESS && event.type == NVME_AER_NOTICE &&
+        event.info == NVME_AER_NOTICE_NS_CHANGED) {
+        /* Changed namespace list; 0xffffffff in the first entry means more
+         * than 1024 namespaces changed. */
+        uint32_t nsids[ASYNC_EVENT_LOG_SIZE / sizeof(uint32_t)];
+
+        memory_space->read(async_event_bufs + slot * ASYNC_EVENT_LOG_SIZE,
+                           nsids, sizeof(nsids));
+
+        if (endian::little_to_native(nsids[0]) == NVME_NSID_ALL) {
+            for (unsigned int nsid = 1; nsid <= nr_namespaces; nsid++)
+                refresh_namespace(nsid);
+        } else {
+            for (auto nsid : nsids) {
+                if (!nsid) break;
+                refresh_namespace(endian::little_to_native(nsid));
+            }
+        }
+    }
+
+    if (async_event_callback) async_event_callback(event);
+
+    submit_async_event(slot);
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::get_log_page(unsigned int nsid,
+                                                uint8_t lid,
+                                                MemorySpace::Address buf,
+                                                size_t size, uint64_t offset)
+{
+    struct nvme_command c;
+    uint32_t numd = size / 4 - 1;
+
+    assert(size >= 4 && !(size & 3) && !(offset & 3));
+
+    memset(&c, 0, sizeof(c));
+    c.get_log_page.opcode = nvme_admin_get_log_page;
+    c.get_log_page.nsid = endian::native_to_little(nsid);
+    c.get_log_page.lid = lid;
+    c.get_log_page.numdl = endian::native_to_little((uint16_t)(numd & 0xffff));
+    c.get_log_page.numdu = endian::native_to_little((uint16_t)(numd >> 16));
+    c.get_log_page.lpol = endian::native_to_little((uint32_t)offset);
+    c.get_log_page.lpou = endian::native_to_little((uint32_t)(offset >> 32));
+
+    return submit_sync_command(queues[0].get(), &c, buf, size, nullptr);
+}
+
+void NVMeDriver::get_smart_log(struct nvme_smart_log* log)
+{
+    auto buf = memory_space->allocate_pages(sizeof(*log));
+    auto status =
+        get_log_page(NVME_NSID_ALL, NVME_LOG_SMART, buf, sizeof(*log));
+
+    if (status == NVME_SC_SUCCESS) memory_space->read(buf, log, sizeof(*log));
+
+    memory_space->free(buf, sizeof(*log));
+
+    if (status != NVME_SC_SUCCESS)
+        throw DeviceIOError("Failed to read SMART log");
+}
+
+size_t NVMeDriver::get_error_log(struct nvme_error_log_entry* entries,
+                                 size_t max)
+{
+    /* ELPE is 0's based. */
+    size_t count = std::min(max, id_ctrl ? id_ctrl->elpe + 1UL : 1UL);
+    size_t size = count * sizeof(*entries);
+
+    if (!count) return 0;
+
+    auto buf = memory_space->allocate_pages(size);
+    auto status = get_log_page(NVME_NSID_ALL, NVME_LOG_ERROR, buf, size);
+
+    if (status == NVME_SC_SUCCESS) memory_space->read(buf, entries, size);
+
+    memory_space->free(buf, size);
+
+    if (status != NVME_SC_SUCCESS)
+        throw DeviceIOError("Failed to read error log");
+
+    return count;
+}
+
+void NVMeDriver::dbbuf_config()
+{
+    struct nvme_command c;
+    NVMeStatus status;
+
+    memset(&c, 0, sizeof(c));
+    c.common.opcode = nvme_admin_dbbuf;
+    c.common.dptr.prp1 = endian::native_to_little(dbbuf_dbs);
+    c.common.dptr.prp2 = endian::native_to_little(dbbuf_eis);
+
+    status = submit_sync_command(queues[0].get(), &c, 0, 0, nullptr);
+
+    if (status == NVME_SC_SUCCESS) return;
+
+    /* Not fatal: the queues keep using MMIO doorbells. */
+    spdlog::warn("Failed to set dbbuf on device, status {:#x}", status);
+
+    for (size_t qid = 1; qid < queue_count; qid++) {
+        auto* nvmeq = queues[qid].get();
+
+        nvmeq->dbbuf_sq_db = nullptr;
+        nvmeq->dbbuf_cq_db = nullptr;
+        nvmeq->dbbuf_sq_ei = nullptr;
+        nvmeq->dbbuf_cq_ei = nullptr;
+    }
+
+    /* Nor should queues created later on. */
+    memory_space->free(dbbuf_dbs, 0x1000);
+    memory_space->free(dbbuf_eis, 0x1000);
+    dbbuf_dbs = 0;
+    dbbuf_eis = 0;
+}
+
+void NVMeDriver::setup_admin_queue()
+{
+    disable_controller();
+
+    allocate_queue(0, NVME_AQ_DEPTH);
+
+    auto& nvmeq = queues.front();
+    uint32_t aqa = nvmeq->depth - 1;
+    aqa |= aqa << 16;
+
+    uint64_t asq = nvmeq->sq_dma_addr;
+    uint64_t acq = nvmeq->cq_dma_addr;
+
+    link->writel((uint64_t)NVME_REG_AQA, aqa);
+    link->writeq((uint64_t)NVME_REG_ASQ, asq);
+    link->writeq((uint64_t)NVME_REG_ACQ, acq);
+
+    enable_controller();
+
+    init_queue(0);
+}
+
+void NVMeDriver::setup_cmb()
+{
+    uint32_t cmbsz, cmbloc;
+    uint64_t szu, bar_addr;
+
+    cmb_bar_addr = 0;
+
+    if (!use_cmb_sqs) return;
+
+    cmbsz = link->readl(NVME_REG_CMBSZ);
+    cmbloc = link->readl(NVME_REG_CMBLOC);
+
+    if (!(cmbsz & NVME_CMBSZ_SQS)) {
+        spdlog::warn("Controller does not support submission queues in the "
+                     "controller memory buffer, using host memory");
+        return;
+    }
+
+    if (NVME_CMB_BIR(cmbloc) != 4 || !bar4_mem) {
+        spdlog::warn("Controller memory buffer is not in a mapped BAR4 "
+                     "(BIR={}), using host memory for submission queues",
+                     NVME_CMB_BIR(cmbloc));
+        return;
+    }
+
+    bar_addr = link->get_bar_address(4);
+    if (!bar_addr) {
+        spdlog::warn("Cannot find the bus address of BAR4, using host memory "
+                     "for submission queues");
+        return;
+    }
+
+    /* Size unit is 4KiB * 16^SZU. */
+    szu = 1ULL << (12 + 4 * ((cmbsz >> NVME_CMBSZ_SZU_SHIFT) &
+                             NVME_CMBSZ_SZU_MASK));
+    cmb_start = szu * NVME_CMB_OFST(cmbloc);
+    cmb_end = cmb_start +
+              szu * ((cmbsz >> NVME_CMBSZ_SZ_SHIFT) & NVME_CMBSZ_SZ_MASK);
+    cmb_end = std::min(cmb_end, bar4_mem->get_map_size());
+    cmb_bar_addr = bar_addr;
+
+    spdlog::info("Placing submission queues in the controller memory buffer "
+                 "bar_addr={:#x} offset={:#x} size={:#x}",
+                 cmb_bar_addr, cmb_start, cmb_end - cmb_start);
+}
+
+bool NVMeDriver::allocate_cmb_sq(NVMeQueue* nvmeq, unsigned qid)
+{
+    MemorySpace::Address addr;
+    size_t size = SQ_SIZE(nvmeq);
+
+    /* BAR4 also serves as the StorPU scratchpad. */
+    try {
+        addr = bar4_mem->allocate_pages(size);
+    } catch (MemorySpace::MemoryNotAvailable&) {
+        spdlog::warn("Controller memory buffer exhausted, using host memory "
+                     "for NVMe SQ {}",
+                     qid);
+        return false;
+    }
+
+    if (addr < cmb_start || addr + size > cmb_end) {
+        bar4_mem->free_pages(addr, size);
+        spdlog::warn("No room in the controller memory buffer, using host "
+                     "memory for NVMe SQ {}",
+                     qid);
+        return false;
+    }
+
+    nvmeq->sq_dma_addr = addr;
+    return true;
+}
+
+void NVMeDriver::setup_io_queues()
+{
+    int nr_io_queues = queues.size() - 1;
+    int max_qs;
+    NVMeStatus status;
+
+    status = set_queue_count(nr_io_queues);
+    if (status || nr_io_queues == 0) {
+        throw DeviceIOError("Failed to set queue count on device");
+    }
+
+    /* PRP list pages needed by the largest transfer, which may start at
+     * any offset into its first page. */
+    size_t entries_per_page = ctrl_page_size >> 3;
+    size_t nprps = (max_transfer_size + ctrl_page_size - 1) / ctrl_page_size;
+
+    if (nprps <= 2)
+        prp_pages_per_cmd = 0;
+    else if (nprps <= entries_per_page)
+        prp_pages_per_cmd = 1;
+    else
+        prp_pages_per_cmd = (nprps - 2) / (entries_per_page - 1) + 1;
+
+    config_irq_coalescing();
+    config_arbitration();
+    setup_cmb();
+
+    for (int i = queue_count; i <= nr_io_queues; i++) {
+        allocate_queue(i, queue_depth);
+    }
+
+    /* Queues are created on first use instead. */
+    if (lazy_queues) return;
+
+    max_qs = std::min(queue_count - 1, (size_t)nr_io_queues);
+
+    create_io_queues(online_queues, max_qs);
+}
+
+std::vector<NVMeDriver::NVMeStatus>
+NVMeDriver::submit_admin_commands(std::vector<struct nvme_command>& cmds)
+{
+    auto* adminq = queues.front().get();
+    std::vector<NVMeStatus> statuses;
+    std::deque<AsyncCommand*> inflight;
+
+    statuses.reserve(cmds.size());
+
+    for (auto&& c : cmds) {
+        if (inflight.size() >= ADMIN_PIPELINE_DEPTH) {
+            statuses.push_back(inflight.front()->wait(nullptr));
+            inflight.pop_front();
+        }
+
+        inflight.push_back(
+            submit_command(adminq, &c, 0, 0, nullptr, 0, {}, nullptr));
+    }
+
+    for (auto* acmd : inflight)
+        statuses.push_back(acmd->wait(nullptr));
+
+    return statuses;
+}
+
+void NVMeDriver::create_io_queues(unsigned int first, unsigned int last)
+{
+    std::vector<struct nvme_command> cmds;
+    std::vector<NVMeStatus> statuses;
+    unsigned int nr_cqs;
+
+    if (first > last) return;
+
+    /* The controller may execute admin commands out of order, so all CQs
+     * are created before any SQ is bound to one. */
+    cmds.resize(last - first + 1);
+    for (unsigned int qid = first; qid <= last; qid++)
+        init_create_cq(&cmds[qid - first], queues[qid].get(), qid, qid);
+
+    statuses = submit_admin_commands(cmds);
+
+    for (nr_cqs = 0; nr_cqs < statuses.size(); nr_cqs++) {
+        if (statuses[nr_cqs] != NVME_SC_SUCCESS) {
+            spdlog::warn("Failed to create NVMe CQ {} status={:#x}",
+                         first + nr_cqs, statuses[nr_cqs]);
+            break;
+        }
+    }
+
+    cmds.clear();
+    for (unsigned int qid = first; qid < first + nr_cqs; qid++) {
+        auto* nvmeq = queues[qid].get();
+
+        cmds.emplace_back();
+        init_create_sq(&cmds.back(), nvmeq, qid);
+
+        if (needs_coalescing_disabled(nvmeq)) {
+            cmds.emplace_back();
+            init_disable_coalescing(&cmds.back(), qid);
+        }
+    }
+
+    statuses = submit_admin_commands(cmds);
+
+    for (unsigned int qid = first, i = 0; qid < first + nr_cqs; qid++) {
+        auto* nvmeq = queues[qid].get();
+        NVMeStatus status = statuses[i++];
+
+        if (needs_coalescing_disabled(nvmeq) &&
+            statuses[i++] != NVME_SC_SUCCESS)
+            spdlog::warn("Failed to disable interrupt coalescing for vector {}",
+                         qid);
+
+        if (status != NVME_SC_SUCCESS) {
+            spdlog::warn("Failed to create NVMe SQ {} status={:#x}", qid,
+                         status);
+            break;
+        }
+
+        init_queue(qid);
+    }
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::create_queue(NVMeQueue* nvmeq, unsigned qid)
+{
+    NVMeStatus status;
+
+    status = create_cq(nvmeq, qid, qid);
+    if (status) return status;
+
+    if (needs_coalescing_disabled(nvmeq)) {
+        if (set_features(NVME_FEAT_IRQ_CONFIG, qid | NVME_IRQ_CONFIG_CD,
+                         nullptr) != NVME_SC_SUCCESS)
+            spdlog::warn("Failed to disable interrupt coalescing for vector {}",
+                         qid);
+    }
+
+    status = create_sq(nvmeq, qid);
+    if (status) return status;
+
+    init_queue(qid);
+    return 0;
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::create_cq(NVMeQueue* nvmeq, unsigned qid,
+                                             unsigned int vector)
+{
+    struct nvme_command c;
+
+    init_create_cq(&c, nvmeq, qid, vector);
+
+    return submit_sync_command(queues[0].get(), &c, 0, 0, nullptr);
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::create_sq(NVMeQueue* nvmeq, unsigned qid)
+{
+    struct nvme_command c;
+
+    init_create_sq(&c, nvmeq, qid);
+
+    return submit_sync_command(queues[0].get(), &c, 0, 0, nullptr);
+}
+
+void NVMeDriver::init_disable_coalescing(struct nvme_command* c, unsigned qid)
+{
+    memset(c, 0, sizeof(*c));
+    c->features.opcode = nvme_admin_set_features;
+    c->features.fid =
+        endian::native_to_little((unsigned int)NVME_FEAT_IRQ_CONFIG);
+    c->features.dword11 =
+        endian::native_to_little((unsigned int)(qid | NVME_IRQ_CONFIG_CD));
+}
+
+void NVMeDriver::init_create_cq(struct nvme_command* c, NVMeQueue* nvmeq,
+                                unsigned qid, unsigned int vector)
+{
+    int flags = NVME_QUEUE_PHYS_CONTIG;
+
+    if (nvmeq->mode == CompletionMode::INTERRUPT) flags |= NVME_CQ_IRQ_ENABLED;
+
+    memset(c, 0, sizeof(*c));
+    c->create_cq.opcode = nvme_admin_create_cq;
+    c->create_cq.prp1 =
+        endian::native_to_little((uint64_t)nvmeq->cq_dma_addr);
+    c->create_cq.cqid = endian::native_to_little(qid);
+    c->create_cq.qsize = endian::native_to_little(nvmeq->depth - 1);
+    c->create_cq.cq_flags = endian::native_to_little(flags);
+    c->create_cq.irq_vector = endian::native_to_little(vector);
+}
+
+void NVMeDriver::init_create_sq(struct nvme_command* c, NVMeQueue* nvmeq,
+                                unsigned qid)
+{
+    int flags = NVME_QUEUE_PHYS_CONTIG;
+
+    if (use_wrr) {
+        switch (nvmeq->priority) {
+        case QueuePriority::URGENT:
+            flags |= NVME_SQ_PRIO_URGENT;
+            break;
+        case QueuePriority::HIGH:
+            flags |= NVME_SQ_PRIO_HIGH;
+            break;
+        case QueuePriority::MEDIUM:
+            flags |= NVME_SQ_PRIO_MEDIUM;
+            break;
+        case QueuePriority::LOW:
+            flags |= NVME_SQ_PRIO_LOW;
+            break;
+        }
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->create_sq.opcode = nvme_admin_create_sq;
+    c->create_sq.prp1 = endian::native_to_little(
+        nvmeq->sq_in_cmb ? cmb_bar_addr + nvmeq->sq_dma_addr
+                         : (uint64_t)nvmeq->sq_dma_addr);
+    c->create_sq.sqid = endian::native_to_little(qid);
+    c->create_sq.qsize = endian::native_to_little(nvmeq->depth - 1);
+    c->create_sq.sq_flags = endian::native_to_little(flags);
+    c->create_sq.cqid = endian::native_to_little(qid);
+}
+
+NVMeDriver::NVMeStatus NVMeDriver::identify_controller()
+{
+    struct nvme_command c = {0};
+    auto& adminq = queues.front();
+    MemorySpace::Address id_buf;
+    int status;
+
+    memset(&c, 0, sizeof(c));
+    c.identify.opcode = nvme_admin_identify;
+    c.identify.cns = NVME_ID_CNS_CTRL;
+
+    id_buf = memory_space->allocate_pages(sizeof(struct nvme_id_ctrl));
+
+    status = submit_sync_command(adminq.get(), &c, id_buf,
+                                 sizeof(struct nvme_id_ctrl), nullptr);
+
+    if (status == NVME_SC_SUCCESS) {
+        id_ctrl = std::make_unique<struct nvme_id_ctrl>();
+        memory_space->read(id_buf, id_ctrl.get(), sizeof(struct nvme_id_ctrl));
+
+        ctrl_sgls = endian::little_to_native(id_ctrl->sgls);
+        ctrl_oncs = endian::little_to_native(id_ctrl->oncs);
+
+        if (ctrl_sgls & NVME_CTRL_SGLS_MASK)
+            spdlog::info("Controller supports SGLs sgls={:#x}", ctrl_sgls);
+
+        /* MDTS is a power of two in units of the minimum memory page
+         * size, 0 for no limit. */
+        if (id_ctrl->mdts) {
+            size_t mdts = 1UL << (NVME_CAP_MPSMIN(ctrl_cap) + 12 +
+                                  id_ctrl->mdts);
+
+            if (max_transfer_size > mdts) {
+                spdlog::info("Limiting maximum transfer size to {} bytes "
+                             "(MDTS {})",
+                             mdts, id_ctrl->mdts);
+                max_transfer_size = mdts;
+            }
+        }
+    }
+
+    /* The 16-bit 0's based block count in read/write commands, for the
+     * smallest LBA size. */
+    max_transfer_size =
+        std::min(max_transfer_size, MAX_RW_BLOCKS << MIN_LBA_SHIFT);
+
+    /* Namespaces are identified lazily. */
+    nr_namespaces = MAX_NAMESPACES;
+    if (id_ctrl && id_ctrl->nn)
+        nr_namespaces =
+            std::min(endian::little_to_native(id_ctrl->nn), MAX_NAMESPACES);
+
+    namespaces = std::make_unique<NamespaceSlot[]>(nr_namespaces);
+    for (unsigned int i = 0; i < nr_namespaces; i++)
+        namespaces[i].info.store(nullptr, std::memory_order_relaxed);
+
+    memory_space->free(id_buf, sizeof(struct nvme_id_ctrl));
+
+    return status;
+}
+
+void NVMeDriver::init_identify_namespace(struct nvme_command* c,
+                                         unsigned int nsid)
+{
+    memset(c, 0, sizeof(*c));
+    c->identify.opcode = nvme_admin_identify;
+    c->identify.nsid = endian::native_to_little(nsid);
+    c->identify.cns = NVME_ID_CNS_NS;
+}
+
+void NVMeDriver::identify_namespace(unsigned int nsid)
+{
+    struct nvme_command c = {0};
+    auto& adminq = queues.front();
+    MemorySpace::Address id_buf;
+    int status;
+
+    if (!nsid || nsid > nr_namespaces) throw NamespaceUnavailableError();
+
+    init_identify_namespace(&c, nsid);
+    id_buf = memory_space->allocate_pages(sizeof(struct nvme_id_ns));
+
+    status = submit_sync_command(adminq.get(), &c, id_buf,
+                                 sizeof(struct nvme_id_ns), nullptr);
+    update_namespace(nsid, status, id_buf);
+
+    memory_space->free(id_buf, sizeof(struct nvme_id_ns));
+
+    if (namespaces[nsid - 1].info.load(std::memory_order_acquire) ==
+        &INACTIVE_NAMESPACE)
+        throw NamespaceUnavailableError();
+}
+
+void NVMeDriver::refresh_namespace(unsigned int nsid)
+{
+    struct nvme_command c;
+    MemorySpace::Address id_buf;
+
+    /* Namespaces not used yet are identified on first use. This runs in
+     * the completion path, so the command must not be waited for. */
+    if (!nsid || nsid > nr_namespaces ||
+        !namespaces[nsid - 1].info.load(std::memory_order_acquire))
+        return;
+
+    try {
+        id_buf = memory_space->allocate_pages(sizeof(struct nvme_id_ns));
+    } catch (MemorySpace::MemoryNotAvailable&) {
+        spdlog::warn("Failed to refresh namespace {}, no memory", nsid);
+        return;
+    }
+
+    init_identify_namespace(&c, nsid);
+
+    (void)submit_async_command(
+        queues[0].get(), &c, id_buf, sizeof(struct nvme_id_ns),
+        [this, nsid, id_buf](NVMeStatus status, const NVMeResult&) {
+            update_namespace(nsid, status, id_buf);
+            memory_space->free(id_buf, sizeof(struct nvme_id_ns));
+        });
+}
+
+void NVMeDriver::update_namespace(unsigned int nsid, NVMeStatus status,
+                                  MemorySpace::Address id_buf)
+{
+    NamespaceInfo info;
+
+    if ((status & 0x7ff) == NVME_SC_SUCCESS) {
+        auto id_ns = std::make_unique<struct nvme_id_ns>();
+
+        memory_space->read(id_buf, id_ns.get(), sizeof(struct nvme_id_ns));
+
+        const auto& lbaf = id_ns->lbaf[id_ns->flbas & NVME_NS_FLBAS_LBA_MASK];
+
+        /* Inactive namespaces identify as all zeroes. */
+        if (!id_ns->nsze || lbaf.ds < MIN_LBA_SHIFT) {
+            invalidate_namespace(nsid);
+            return;
+        }
+
+        info.nsze = endian::little_to_native(id_ns->nsze);
+        info.ncap = endian::little_to_native(id_ns->ncap);
+        info.lba_shift = lbaf.ds;
+        info.metadata_size = endian::little_to_native(lbaf.ms);
+        info.extended_lba = id_ns->flbas & NVME_NS_FLBAS_META_EXT;
+
+        if (info.metadata_size)
+            spdlog::warn("Namespace {} has {} bytes of metadata per block "
+                         "which are not transferred",
+                         nsid, info.metadata_size);
+    } else if ((status & 0x7ff) == NVME_SC_NS_ID_UNAVAILABLE) {
+        invalidate_namespace(nsid);
+        return;
+    } else if (namespaces[nsid - 1].info.load(std::memory_order_acquire)) {
+        spdlog::warn("Failed to refresh namespace {} status={:#x}", nsid,
+                     status);
+        return;
+    } else {
+        spdlog::warn("Failed to identify namespace {}, assuming 4096-byte "
+                     "blocks",
+                     nsid);
+        info = {0, 0, 12, 0, false};
+    }
+
+    auto snapshot = std::make_unique<NamespaceInfo>(info);
+    const NamespaceInfo* ptr = snapshot.get();
+
+    {
+        std::lock_guard<std::mutex> lock(ns_mutex);
+        namespace_infos.push_back(std::move(snapshot));
+    }
+
+    set_namespace(nsid, ptr);
+
+    spdlog::info("Namespace {}: {} blocks of {} bytes", nsid, info.nsze,
+                 1U << info.lba_shift);
+}
+
+void NVMeDriver::set_namespace(unsigned int nsid, const NamespaceInfo* info)
+{
+    if (nsid && nsid <= nr_namespaces)
+        namespaces[nsid - 1].info.store(info, std::memory_order_release);
+}
+
+bool NVMeDriver::cqe_pending(NVMeQueue* nvmeq)
+{
+    uint16_t status;
+
+    assert(nvmeq->cq_head < nvmeq->depth);
+    /* Pairs with the device writing the phase bit last; the rest of the
+     * entry may be read once the new phase is observed. */
+    status = __atomic_load_n(&nvmeq->cqes[nvmeq->cq_head].status,
+                             __ATOMIC_ACQUIRE);
+    endian::little_to_native_inplace(status);
+    return (status & 1) == nvmeq->cq_phase;
+}
+
+void NVMeDriver::handle_cqe(NVMeQueue* nvmeq, uint16_t idx)
+{
+    const struct nvme_completion* cqe;
+    uint16_t command_id;
+
+    assert(idx < nvmeq->depth);
+    cqe = &nvmeq->cqes[idx];
+
+    command_id = cqe->command_id;
+
+    if (command_id >= nvmeq->depth) {
+        spdlog::error("Completion queue entry without command id={}",
+                      command_id);
+        return;
+    }
+
+    auto* cmd = &nvmeq->commands[command_id];
+    NVMeStatus status = endian::little_to_native(cqe->status) >> 1;
+
+    UNVME_TRACE_EVENT(CQE, nvmeq->qid, command_id, status);
+
+    nvmeq->sq_head.store(endian::little_to_native(cqe->sq_head),
+                         std::memory_order_release);
+
+    uint64_t service_ns = 0;
+
+    counter_add(nvmeq->completed, 1);
+
+    if (nvmeq->mode == CompletionMode::HYBRID || hedge_percentile ||
+        nvmeq->latency_hist)
+        service_ns = now_ns() - cmd->submit_time;
+
+    if (nvmeq->latency_hist) {
+        counter_add(nvmeq->latency_hist[latency_bucket(service_ns)], 1);
+        counter_add(nvmeq->latency_sum_ns, service_ns);
+    }
+
+    if (nvmeq->mode == CompletionMode::HYBRID) {
+        /* EWMA with weight 1/8 of the submit-to-completion time. */
+        int64_t mean = nvmeq->mean_service_ns.load(std::memory_order_relaxed);
+        int64_t sample = service_ns;
+
+        mean = mean ? mean + (sample - mean) / 8 : sample;
+        nvmeq->mean_service_ns.store(mean, std::memory_order_relaxed);
+    }
+
+    if (hedge_percentile && nvmeq->qid && cmd->opcode == nvme_cmd_read)
+        record_read_latency(service_ns);
+
+    /* Callbacks run once the whole batch is reaped; the slot is free from
+     * here on. */
+    if (cmd->callback) {
+        nvmeq->reaped.push_back(
+            {std::move(cmd->callback), cmd->context, status, cqe->result});
+        remove_async_command(cmd);
+    } else if (cmd->context) {
+        nvmeq->reaped.push_back({nullptr, cmd->context, status, cqe->result});
+        remove_async_command(cmd);
+    } else {
+        cmd->status = status;
+        cmd->result = cqe->result;
+
+        if (cmd->state.exchange(AsyncCommand::CMD_COMPLETED,
+                                std::memory_order_acq_rel) ==
+            AsyncCommand::CMD_WAITING)
+            futex_wake(&cmd->state);
+    }
+}
+
+void NVMeDriver::start_watchdog()
+{
+    watchdog_stop.store(false, std::memory_order_relaxed);
+    watchdog = std::thread([this]() { run_watchdog(); });
+
+    spdlog::info("Command watchdog started tick={}us timeout={}ms hedging={}",
+                 timer_tick_ns / 1000, command_timeout_ns / 1000000,
+                 hedge_percentile);
+}
+
+void NVMeDriver::stop_watchdog()
+{
+    watchdog_stop.store(true, std::memory_order_relaxed);
+
+    if (!watchdog.joinable()) return;
+
+    watchdog.join();
+
+    for (size_t qid = 0; qid < queue_count; qid++)
+        drain_timers(queues[qid].get());
+}
+
+void NVMeDriver::drain_timers(NVMeQueue* nvmeq)
+{
+    auto& drained = expired_timers;
+
+    if (!nvmeq->timers) return;
+
+    std::unique_lock<std::mutex> lock(nvmeq->timer_mutex);
+
+    for (unsigned int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        auto* head = &nvmeq->timers[i];
+
+        while (head->next != head) {
+            auto* timer = head->next;
+
+            if (timer->hedge) drained.push_back(*timer);
+            unlink_timer(timer);
+        }
+    }
+
+    lock.unlock();
+
+    /* Hedge timers hold a reference on their read. */
+    for (auto&& entry : drained)
+        put_hedged_read(entry.hedge);
+
+    drained.clear();
+}
+
+void NVMeDriver::run_watchdog()
+{
+    uint64_t nr_ticks = 0;
+
+    while (!watchdog_stop.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(timer_tick_ns));
+
+        uint64_t tick = now_ns() / timer_tick_ns;
+
+        if (hedge_percentile && nr_ticks++ % HEDGE_UPDATE_TICKS == 0)
+            update_hedge_delay();
+
+        try {
+            for (size_t qid = 0; qid < queue_count; qid++)
+                expire_timers(queues[qid].get(), tick);
+        } catch (const std::runtime_error& e) {
+            spdlog::error("Command watchdog error: {}", e.what());
+        }
+    }
+}
+
+void NVMeDriver::arm_timer(NVMeQueue* nvmeq, TimerEntry* timer,
+                           const TimerEntry& entry, uint64_t delay_ns)
+{
+    uint64_t expires =
+        now_ns() / timer_tick_ns +
+        std::max((delay_ns + timer_tick_ns - 1) / timer_tick_ns, (uint64_t)1);
+
+    std::lock_guard<std::mutex> lock(nvmeq->timer_mutex);
+
+    if (timer->next) {
+        /* The slot may have been reused since a deadline expired. */
+        if ((int32_t)(entry.gen - timer->gen) < 0) return;
+
+        unlink_timer(timer);
+    }
+
+    timer->expires = expires;
+    timer->hedge = entry.hedge;
+    timer->gen = entry.gen;
+    timer->cid = entry.cid;
+    timer->aborted = entry.aborted;
+
+    auto* head = &nvmeq->timers[expires % TIMER_WHEEL_SLOTS];
+
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void NVMeDriver::unlink_timer(TimerEntry* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+}
+
+void NVMeDriver::expire_timers(NVMeQueue* nvmeq, uint64_t tick)
+{
+    auto& expired = expired_timers;
+
+    std::unique_lock<std::mutex> lock(nvmeq->timer_mutex);
+
+    /* One lap visits every bucket. */
+    if (tick >= nvmeq->timer_tick + TIMER_WHEEL_SLOTS)
+        nvmeq->timer_tick = tick - TIMER_WHEEL_SLOTS + 1;
+
+    for (; nvmeq->timer_tick <= tick; nvmeq->timer_tick++) {
+        auto* head = &nvmeq->timers[nvmeq->timer_tick % TIMER_WHEEL_SLOTS];
+
+        /* Entries due in a later lap stay in the bucket. Copies are taken
+         * as a deadline may be rearmed for the next command in its slot
+         * once unlinked. */
+        for (auto* timer = head->next; timer != head;) {
+            auto* next = timer->next;
+
+            if (timer->expires <= tick) {
+                expired.push_back(*timer);
+                unlink_timer(timer);
+            }
+
+            timer = next;
+        }
+    }
+
+    lock.unlock();
+
+    for (auto&& entry : expired) {
+        if (entry.hedge)
+            issue_hedge(entry.hedge);
+        else
+            handle_timeout(nvmeq, entry);
+    }
+
+    expired.clear();
+}
+
+void NVMeDriver::handle_timeout(NVMeQueue* nvmeq, TimerEntry entry)
+{
+    auto* cmd = &nvmeq->commands[entry.cid];
+
+    /* Completed, or the slot has been released since. */
+    if (cmd->gen.load(std::memory_order_acquire) != entry.gen ||
+        cmd->state.load(std::memory_order_acquire) ==
+            AsyncCommand::CMD_COMPLETED)
+        return;
+
+    if (entry.aborted) {
+        spdlog::error("Command {} on queue {} not completed after abort",
+                      entry.cid, nvmeq->qid);
+        return;
+    }
+
+    spdlog::warn("Command {} on queue {} timed out, aborting", entry.cid,
+                 nvmeq->qid);
+
+    abort_command(nvmeq, entry.cid, entry.gen);
+
+    entry.aborted = true;
+    arm_timer(nvmeq, &nvmeq->deadlines[entry.cid], entry, command_timeout_ns);
+}
+
+void NVMeDriver::abort_command(NVMeQueue* nvmeq, uint16_t cid, uint32_t gen)
+{
+    auto* cmd = &nvmeq->commands[cid];
+    struct nvme_command c;
+    uint16_t qid = nvmeq->qid;
+
+    /* The command may have completed since the caller looked at it, and
+     * the cid may already belong to another command. Check again right
+     * before the abort goes out. */
+    if (cmd->gen.load(std::memory_order_acquire) != gen ||
+        cmd->state.load(std::memory_order_acquire) ==
+            AsyncCommand::CMD_COMPLETED)
+        return;
+
+    memset(&c, 0, sizeof(c));
+    c.abort.opcode = nvme_admin_abort_cmd;
+    c.abort.sqid = endian::native_to_little(qid);
+    c.abort.cid = cid;
+
+    (void)submit_async_command(
+        queues[0].get(), &c, 0, 0,
+        [qid, cid](NVMeStatus status, const NVMeResult& result) {
+            /* Bit 0 of dword 0 is set if the command was not aborted. */
+            if (status != NVME_SC_SUCCESS ||
+                (endian::little_to_native(result.u32) & 1))
+                spdlog::warn("Failed to abort command {} on queue {} "
+                             "status={:#x}",
+                             cid, qid, status);
+        });
+}
+
+void NVMeDriver::record_read_latency(uint64_t ns)
+{
+    read_latency_hist[latency_bucket(ns)].fetch_add(1,
+                                                   std::memory_order_relaxed);
+}
+
+void NVMeDriver::update_hedge_delay()
+{
+    uint64_t total = 0, count = 0, threshold;
+
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        total += read_latency_hist[i].load(std::memory_order_relaxed);
+
+    if (total < HEDGE_MIN_SAMPLES) return;
+
+    threshold = std::max((uint64_t)(total * hedge_percentile / 100), 1UL);
+
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+        count += read_latency_hist[i].load(std::memory_order_relaxed);
+
+        if (count >= threshold) {
+            hedge_delay_ns.store(latency_bucket_limit(i),
+                                 std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+NVMeDriver::NVMeQueue* NVMeDriver::get_hedge_queue(NVMeQueue* nvmeq)
+{
+    size_t nr_io_queues = nr_bindable_queues();
+
+    /* Polled queues are only reaped by their owners, and lazily created
+     * queues may not exist yet. */
+    for (size_t i = 1; i < nr_io_queues; i++) {
+        auto* q = queues[(nvmeq->qid - 1 + i) % nr_io_queues + 1].get();
+
+        if (q->mode == CompletionMode::INTERRUPT &&
+            q->online.load(std::memory_order_acquire))
+            return q;
+    }
+
+    return nullptr;
+}
+
+NVMeDriver::AsyncCommand* NVMeDriver::submit_hedged_read(
+    struct nvme_command* cmd, unsigned int nsid, unsigned int lba_shift,
+    loff_t pos, MemorySpace::Address buf, size_t size,
+    AsyncCommandCallback&& callback, void* context, bool nowait)
+{
+    auto* nvmeq = thread_context().io_queue;
+    auto* hr = new HedgedRead();
+
+    /* The original command and the hedge timer. */
+    hr->refs.store(2, std::memory_order_relaxed);
+    hr->primary_done = false;
+    hr->hedge_issued = false;
+    hr->hedge_done = false;
+    hr->delivered = false;
+    hr->primary_status = NVME_SC_SUCCESS;
+    hr->hedge_status = NVME_SC_SUCCESS;
+    hr->callback = std::move(callback);
+    hr->context = context;
+    hr->nvmeq = nvmeq;
+    hr->nsid = nsid;
+    hr->lba_shift = lba_shift;
+    hr->pos = pos;
+    hr->buf = buf;
+    hr->bounce = 0;
+    hr->size = size;
+
+    /* The hedge timer is armed once the command is in the SQ. */
+    auto* acmd = submit_command(
+        nvmeq, cmd, buf, size, nullptr, 0,
+        [this, hr](NVMeStatus status, const NVMeResult& result) {
+            complete_hedged_read(hr, false, status, result);
+        },
+        nullptr, nowait, hr);
+
+    if (!acmd) {
+        if (nowait) {
+            /* Not submitted and the callback is not to be invoked. */
+            delete hr;
+            return nullptr;
+        }
+
+        /* Parked in the overflow queue: not hedged. */
+        put_hedged_read(hr);
+        return nullptr;
+    }
+
+    return acmd;
+}
+
+void NVMeDriver::issue_hedge(HedgedRead* hr)
+{
+    auto* target = get_hedge_queue(hr->nvmeq);
+    struct nvme_command c;
+
+    std::unique_lock<std::mutex> lock(hr->mutex);
+
+    if (hr->primary_done || !target) {
+        lock.unlock();
+        put_hedged_read(hr);
+        return;
+    }
+
+    try {
+        hr->bounce = memory_space->allocate_pages(hr->size);
+    } catch (MemorySpace::MemoryNotAvailable&) {
+        lock.unlock();
+        put_hedged_read(hr);
+        return;
+    }
+
+    hr->hedge_issued = true;
+    hr->refs.fetch_add(1, std::memory_order_relaxed);
+    lock.unlock();
+
+    hedges_issued.fetch_add(1, std::memory_order_relaxed);
+
+    init_rw_command(&c, false, hr->nsid, hr->pos, hr->size, hr->lba_shift);
+
+    try {
+        (void)submit_command(
+            target, &c, hr->bounce, hr->size, nullptr, 0,
+            [this, hr](NVMeStatus status, const NVMeResult& result) {
+                complete_hedged_read(hr, true, status, result);
+            });
+    } catch (const std::runtime_error&) {
+        complete_hedged_read(hr, true, NVME_SC_INTERNAL, NVMeResult());
+    }
+
+    put_hedged_read(hr);
+}
+
+void NVMeDriver::complete_hedged_read(HedgedRead* hr, bool hedge,
+                                      NVMeStatus status,
+                                      const NVMeResult& result)
+{
+    bool deliver = false, copy = false, abort = false;
+
+    std::unique_lock<std::mutex> lock(hr->mutex);
+
+    if (hedge) {
+        hr->hedge_done = true;
+        hr->hedge_status = status;
+    } else {
+        hr->primary_done = true;
+        hr->primary_status = status;
+        hr->result = result;
+    }
+
+    if (!hr->delivered && hr->primary_done) {
+        /* The original command no longer writes into the buffer. A failed
+         * original waits for an outstanding hedge. */
+        if (hr->primary_status == NVME_SC_SUCCESS || !hr->hedge_issued) {
+            deliver = true;
+        } else if (hr->hedge_done) {
+            deliver = true;
+            copy = hr->hedge_status == NVME_SC_SUCCESS;
+        }
+    } else if (!hr->delivered && hedge && status == NVME_SC_SUCCESS) {
+        /* The hedge won; stop the straggler to get the buffer back. */
+        abort = true;
+    }
+
+    hr->delivered |= deliver;
+    lock.unlock();
+
+    if (abort) abort_command(hr->nvmeq, hr->cid, hr->gen);
+
+    if (deliver) {
+        NVMeStatus out_status =
+            copy ? (NVMeStatus)NVME_SC_SUCCESS : hr->primary_status;
+
+        if (copy) {
+            size_t len = hr->size;
+            auto* src = memory_space->get_raw_ptr(hr->bounce, len);
+
+            assert(src && len == hr->size);
+            memory_space->write(hr->buf, src, hr->size);
+            hedges_won.fetch_add(1, std::memory_order_relaxed);
+        }
 
-    auto it = command_map.emplace(id, std::make_unique<AsyncCommand>()).first;
-    auto& cmd = it->second;
-    cmd->driver = this;
-    cmd->space = memory_space;
-    cmd->id = id;
-    cmd->completed = false;
-    cmd->callback = callback;
+        if (hr->context) {
+            BatchCompletion completion = {hr->context, out_status,
+                                          hr->result};
+            batch_callback(&completion, 1);
+        } else {
+            hr->callback(out_status, hr->result);
+        }
+    }
 
-    return it->second.get();
+    put_hedged_read(hr);
 }
 
-void NVMeDriver::remove_async_command(uint16_t command_id)
+void NVMeDriver::put_hedged_read(HedgedRead* hr)
 {
-    std::lock_guard<std::mutex> guard(command_mutex);
-    command_map.erase(command_id);
+    if (hr->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    if (hr->bounce) memory_space->free(hr->bounce, hr->size);
+    delete hr;
 }
 
-void NVMeDriver::setup_buffer(AsyncCommand* acmd, struct nvme_command* cmd,
-                              MemorySpace::Address buf, size_t buflen)
+std::vector<NVMeDriver::IrqStats> NVMeDriver::get_irq_stats() const
 {
-    auto offset = buf % ctrl_page_size;
+    std::vector<IrqStats> stats;
 
-    if (offset + buflen <= ctrl_page_size * 2) {
-        auto first_prp_len = ctrl_page_size - offset;
+    for (size_t qid = 1; qid < queue_count; qid++) {
+        auto* nvmeq = queues[qid].get();
 
-        cmd->common.dptr.prp1 = endian::native_to_little(buf);
-        if (buflen > first_prp_len)
-            cmd->common.dptr.prp2 =
-                endian::native_to_little(buf + first_prp_len);
+        if (nvmeq->mode != CompletionMode::INTERRUPT) continue;
 
-        return;
+        stats.push_back(
+            {nvmeq->qid, nvmeq->irq_count.load(std::memory_order_relaxed),
+             nvmeq->irq_cqe_count.load(std::memory_order_relaxed)});
     }
 
-    unsigned long prp1, prp2;
+    return stats;
+}
 
-    prp1 = buf;
+std::vector<NVMeDriver::QueueStats> NVMeDriver::get_queue_stats() const
+{
+    std::vector<QueueStats> stats;
+
+    for (size_t qid = 1; qid < queue_count; qid++) {
+        auto* nvmeq = queues[qid].get();
+        QueueStats qs;
+
+        qs.qid = nvmeq->qid;
+        qs.sq_in_cmb = nvmeq->sq_in_cmb;
+        qs.completed = nvmeq->completed.load(std::memory_order_relaxed);
+        qs.submitted = nvmeq->submitted.load(std::memory_order_relaxed);
+        qs.in_flight =
+            qs.submitted > qs.completed ? qs.submitted - qs.completed : 0;
+        qs.max_in_flight =
+            nvmeq->max_in_flight.load(std::memory_order_relaxed);
+        qs.in_flight_sum =
+            nvmeq->in_flight_sum.load(std::memory_order_relaxed);
+        qs.sq_doorbells = nvmeq->sq_doorbells.load(std::memory_order_relaxed);
+        qs.sq_mmio_writes =
+            nvmeq->sq_mmio_writes.load(std::memory_order_relaxed);
+        qs.irq_count = nvmeq->irq_count.load(std::memory_order_relaxed);
+        qs.irq_cqe_count =
+            nvmeq->irq_cqe_count.load(std::memory_order_relaxed);
+        qs.prp_list_pooled =
+            nvmeq->prp_list_pooled.load(std::memory_order_relaxed);
+        qs.prp_list_allocs =
+            nvmeq->prp_list_allocs.load(std::memory_order_relaxed);
+        qs.latency_sum_ns =
+            nvmeq->latency_sum_ns.load(std::memory_order_relaxed);
+
+        if (nvmeq->latency_hist) {
+            for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+                uint64_t count =
+                    nvmeq->latency_hist[i].load(std::memory_order_relaxed);
+
+                if (count)
+                    qs.latency_hist.push_back({latency_bucket_limit(i), count});
+            }
+        }
 
-    buflen -= ctrl_page_size - offset;
-    buf += ctrl_page_size - offset;
+        stats.push_back(std::move(qs));
+    }
 
-    auto prp_list = memory_space->allocate_pages(ctrl_page_size);
-    acmd->prp_lists.push_back(prp_list);
+    return stats;
+}
 
-    prp2 = prp_list;
+unsigned int NVMeDriver::nvme_irq(NVMeQueue* nvmeq)
+{
+    auto& ctx = thread_context();
+    auto& reaped = nvmeq->reaped;
+    unsigned int found = 0;
 
-    int i = 0;
     for (;;) {
-        if (i == ctrl_page_size >> 3) {
-            auto old_prp_list = prp_list;
-            uint64_t last_entry;
+        unsigned int batch = 0;
 
-            prp_list = memory_space->allocate_pages(ctrl_page_size);
-            acmd->prp_lists.push_back(prp_list);
+        while (batch < nvmeq->depth && cqe_pending(nvmeq)) {
+            handle_cqe(nvmeq, nvmeq->cq_head);
+            nvmeq->update_cq_head();
+            batch++;
+        }
+
+        if (!batch) break;
+
+        ring_cq_doorbell(nvmeq);
+        found += batch;
+
+        /* No driver lock is held from here on, so callbacks may submit. */
+        size_t nbatched = 0;
 
-            memory_space->read(old_prp_list + (i - 1) * sizeof(uint64_t),
-                               &last_entry, sizeof(last_entry));
-            memory_space->write(prp_list, &last_entry, sizeof(last_entry));
-            last_entry = endian::native_to_little(prp_list);
-            memory_space->write(old_prp_list + (i - 1) * sizeof(uint64_t),
-                                &last_entry, sizeof(last_entry));
+        UNVME_TRACE_EVENT(CALLBACK_BEGIN, nvmeq->qid, 0, reaped.size());
+        ctx.callback_depth++;
+
+        for (auto&& entry : reaped) {
+            if (entry.callback)
+                entry.callback(entry.status, entry.result);
+            else
+                nvmeq->batched[nbatched++] = {entry.context, entry.status,
+                                              entry.result};
         }
+        reaped.clear();
 
-        uint64_t val = endian::native_to_little(buf);
-        memory_space->write(prp_list + i * sizeof(uint64_t), &val, sizeof(val));
-        i++;
-        buf += ctrl_page_size;
+        if (nbatched) {
+            assert(batch_callback);
+            batch_callback(nvmeq->batched.get(), nbatched);
+        }
 
-        if (buflen <= ctrl_page_size) break;
-        buflen -= ctrl_page_size;
+        ctx.callback_depth--;
+        UNVME_TRACE_EVENT(CALLBACK_END, nvmeq->qid, 0);
     }
 
-    cmd->common.dptr.prp1 = endian::native_to_little(prp1);
-    cmd->common.dptr.prp2 = endian::native_to_little(prp2);
+    if (nvmeq->overflow_count.load(std::memory_order_acquire))
+        drain_overflow(nvmeq);
+
+    return found;
 }
 
-void NVMeDriver::write_sq_doorbell(NVMeQueue* nvmeq, bool write_sq)
+unsigned int NVMeDriver::poll_queue(NVMeQueue* nvmeq)
 {
-    uint32_t tail;
-
-    spdlog::trace("Writing SQ doorbell qid={} tail={}", nvmeq->qid,
-                  nvmeq->sq_tail);
+    if (nvmeq->cq_busy.exchange(true, std::memory_order_acquire)) return 0;
 
-    if (!write_sq) {
-        uint16_t next_tail = nvmeq->sq_tail + 1;
+    if (nvmeq->mode == CompletionMode::HYBRID &&
+        nvmeq->hybrid_armed.exchange(false, std::memory_order_relaxed) &&
+        !cqe_pending(nvmeq)) {
+        /* Sleep through roughly half of the expected service time once per
+         * submission or completion burst, then fall back to spinning. */
+        auto mean = nvmeq->mean_service_ns.load(std::memory_order_relaxed);
 
-        if (next_tail == nvmeq->depth) next_tail = 0;
-        if (next_tail != nvmeq->last_sq_tail) return;
+        if (mean)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(mean / 2));
     }
 
-    tail = nvmeq->sq_tail;
+    auto found = nvme_irq(nvmeq);
 
-    if (nvmeq->dbbuf_sq_db)
-        memory_space->write(nvmeq->dbbuf_sq_db, &tail, sizeof(tail));
-    else
-        link->writel(nvmeq->q_db, tail);
+    if (found && nvmeq->mode == CompletionMode::HYBRID)
+        nvmeq->hybrid_armed.store(true, std::memory_order_relaxed);
 
-    nvmeq->last_sq_tail = nvmeq->sq_tail;
+    nvmeq->cq_busy.store(false, std::memory_order_release);
+
+    return found;
 }
 
-void NVMeDriver::ring_cq_doorbell(NVMeQueue* nvmeq)
+unsigned int NVMeDriver::poll_completions()
 {
-    uint32_t head = nvmeq->cq_head;
+    auto* nvmeq = thread_context().io_queue;
 
-    if (nvmeq->dbbuf_cq_db)
-        memory_space->write(nvmeq->dbbuf_cq_db, &head, sizeof(head));
-    else
-        link->writel(nvmeq->q_db + 4 * db_stride, head);
-}
+    assert(nvmeq && nvmeq->mode != CompletionMode::INTERRUPT);
 
-void NVMeDriver::submit_sq_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
-                                   bool write_sq)
-{
-    memory_space->write(nvmeq->sq_dma_addr +
-                            (nvmeq->sq_tail << nvmeq->sqe_shift),
-                        cmd, sizeof(*cmd));
-    if (++nvmeq->sq_tail == nvmeq->depth) nvmeq->sq_tail = 0;
-    write_sq_doorbell(nvmeq, write_sq);
+    return poll_queue(nvmeq);
 }
 
-NVMeDriver::NVMeStatus
-NVMeDriver::submit_sync_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
-                                MemorySpace::Address buf, size_t buflen,
-                                union nvme_completion::nvme_result* result)
+NVMeDriver::AsyncCommand*
+NVMeDriver::submit_rw_command(bool do_write, unsigned int nsid, loff_t pos,
+                              MemorySpace::Address buf, size_t size,
+                              AsyncCommandCallback&& callback, void* context,
+                              bool nowait)
 {
-    auto* acmd = setup_async_command({});
-
-    cmd->common.command_id = acmd->id;
+    uint16_t control = 0;
+    uint32_t dsmgmt = 0;
+    struct nvme_command cmd;
+    unsigned int lba_shift = get_namespace(nsid).lba_shift;
+    loff_t lba_mask = (1L << lba_shift) - 1;
+    bool unaligned = (pos | size) & lba_mask;
+    /* Blocks covering the request. */
+    loff_t start = pos & ~lba_mask;
+    loff_t end = (pos + size + lba_mask) & ~lba_mask;
+
+    /* Unaligned reads transfer the covering blocks, bit buckets included,
+     * in one command, so those must fit in the limit. */
+    if (unaligned && (size_t)(end - start) > max_transfer_size)
+        throw std::invalid_argument(
+            "Unaligned I/O exceeds maximum transfer size");
+
+    if (size > max_transfer_size) {
+        /* Split into sub-commands on the same queue that complete as one.
+         * The batch context is handed over on the merged completion. */
+        IOSegment seg = {buf, size};
+
+        if (context) {
+            callback = [this, context](NVMeStatus status,
+                                       const NVMeResult& result) {
+                BatchCompletion completion = {context, status, result};
+                batch_callback(&completion, 1);
+            };
+        }
 
-    if (buflen) {
-        setup_buffer(acmd, cmd, buf, buflen);
+        submit_rwv_command(do_write, nsid, pos, &seg, 1, std::move(callback));
+        return nullptr;
     }
 
-    submit_sq_command(nvmeq, cmd, true);
+    init_rw_command(&cmd, do_write, nsid, pos, size, lba_shift);
+    cmd.rw.control = endian::native_to_little(control);
+    cmd.rw.dsmgmt = endian::native_to_little(dsmgmt);
 
-    return acmd->wait(result);
+    if (!do_write && hedge_percentile && !unaligned &&
+        (callback || context) &&
+        hedge_delay_ns.load(std::memory_order_relaxed))
+        return submit_hedged_read(&cmd, nsid, lba_shift, pos, buf, size,
+                                  std::move(callback), context, nowait);
+
+    if (!do_write && unaligned && supports_unaligned_read()) {
+        /* Read the covering blocks and let the controller discard the head
+         * and tail into bit buckets so that only the requested bytes land in
+         * the buffer. */
+        struct nvme_sgl_desc descs[3];
+        size_t ndescs = 0;
+
+        memset(descs, 0, sizeof(descs));
+        if (pos > start) sgl_set_bit_bucket(&descs[ndescs++], pos - start);
+        sgl_set_data(&descs[ndescs++], buf, size);
+        if ((loff_t)(pos + size) < end)
+            sgl_set_bit_bucket(&descs[ndescs++], end - (pos + size));
+
+        cmd.rw.slba = endian::native_to_little(start >> lba_shift);
+        cmd.rw.length =
+            endian::native_to_little(((end - start) >> lba_shift) - 1);
+
+        return submit_command(thread_context().io_queue, &cmd, 0, 0, descs,
+                              ndescs, std::move(callback), context, nowait);
+    }
+
+    return submit_command(thread_context().io_queue, &cmd, buf, size, nullptr,
+                          0, std::move(callback), context, nowait);
 }
 
-NVMeDriver::AsyncCommand*
-NVMeDriver::submit_async_command(NVMeQueue* nvmeq, struct nvme_command* cmd,
-                                 MemorySpace::Address buf, size_t buflen,
-                                 AsyncCommandCallback&& callback)
+void NVMeDriver::submit_rwv_command(bool do_write, unsigned int nsid,
+                                    loff_t pos, const IOSegment* iov,
+                                    size_t iovcnt,
+                                    AsyncCommandCallback&& callback)
 {
-    auto* acmd = setup_async_command(std::move(callback));
-
-    cmd->common.command_id = acmd->id;
-
-    if (buflen) {
-        setup_buffer(acmd, cmd, buf, buflen);
+    auto* nvmeq = thread_context().io_queue;
+    unsigned int lba_shift = get_namespace(nsid).lba_shift;
+    size_t lba_mask = (1UL << lba_shift) - 1;
+    size_t total = 0, ncmds = 0;
+    bool use_sgl = true;
+
+    for (size_t i = 0; i < iovcnt; i++) {
+        total += iov[i].len;
+        use_sgl = use_sgl && sgl_usable(nvmeq, iov[i].addr, iov[i].len);
     }
 
-    submit_sq_command(nvmeq, cmd, true);
+    if (!total || (((size_t)pos | total) & lba_mask))
+        throw std::invalid_argument("I/O vector not block aligned");
 
-    return acmd;
-}
+    /* Without SGLs, commands end at the maximum transfer size and where
+     * segments do not meet on controller page boundaries. */
+    std::vector<size_t> runs;
 
-NVMeDriver::NVMeStatus NVMeDriver::nvme_features(uint8_t op, unsigned int fid,
-                                                 unsigned int dword11,
-                                                 uint32_t* result)
-{
-    struct nvme_command c;
-    union nvme_completion::nvme_result res = {0};
-    NVMeStatus status;
+    if (use_sgl) {
+        ncmds = (total + max_transfer_size - 1) / max_transfer_size;
+    } else {
+        size_t run = 0;
 
-    memset(&c, 0, sizeof(c));
-    c.features.opcode = op;
-    c.features.fid = endian::native_to_little(fid);
-    c.features.dword11 = endian::native_to_little(dword11);
+        for (size_t i = 0; i < iovcnt; i++) {
+            run += iov[i].len;
+            if (i + 1 < iovcnt && prp_mergeable(iov[i], iov[i + 1]))
+                continue;
 
-    status = submit_sync_command(queues[0].get(), &c, 0, 0, &res);
+            if (run & lba_mask)
+                throw std::invalid_argument("I/O segment not block aligned");
 
-    if (result) *result = endian::little_to_native(res.u32);
-    return status;
-}
+            if (run) {
+                runs.push_back(run);
+                ncmds += (run + max_transfer_size - 1) / max_transfer_size;
+            }
+            run = 0;
+        }
+    }
 
-NVMeDriver::NVMeStatus NVMeDriver::set_queue_count(int& count)
-{
-    uint32_t result;
-    uint32_t q_count = (count - 1) | ((count - 1) << 16);
-    int nioqs;
-    NVMeDriver::NVMeStatus status;
+    spdlog::trace("Submitting vectored {} command pos={} size={} "
+                  "segments={} commands={}",
+                  do_write ? "write" : "read", pos, total, iovcnt, ncmds);
 
-    status = set_features(NVME_FEAT_NUM_QUEUES, q_count, &result);
+    /* A request that fits in one command completes with its callback
+     * directly. */
+    VectoredRequest* vreq = nullptr;
+    if (ncmds > 1) vreq = new VectoredRequest(std::move(callback));
 
-    if (status > 0)
-        count = 0;
-    else {
-        nioqs = std::min(result & 0xffff, result >> 16) + 1;
-        count = std::min(count, nioqs);
-    }
+    std::vector<struct nvme_sgl_desc> descs;
+    size_t seg = 0, seg_off = 0, submitted = 0;
+    size_t run = 0, run_left = 0;
 
-    return NVME_SC_SUCCESS;
-}
+    plug();
 
-void NVMeDriver::dbbuf_config()
-{
-    struct nvme_command c;
-    NVMeStatus status;
+    try {
+        while (total) {
+            size_t cmd_len = std::min(total, max_transfer_size);
+            struct nvme_command cmd;
 
-    memset(&c, 0, sizeof(c));
-    c.common.opcode = nvme_admin_dbbuf;
-    c.common.dptr.prp1 = endian::native_to_little(dbbuf_dbs);
+            if (!use_sgl) {
+                if (!run_left) run_left = runs[run++];
 
-    status = submit_sync_command(queues[0].get(), &c, 0, 0, nullptr);
+                cmd_len = std::min(cmd_len, run_left);
+                run_left -= cmd_len;
+            }
 
-    if (status) throw DeviceIOError("Failed to set dbbuf on device");
-}
+            descs.clear();
 
-void NVMeDriver::setup_admin_queue()
-{
-    disable_controller();
+            for (size_t left = cmd_len; left;) {
+                size_t n = std::min(left, iov[seg].len - seg_off);
 
-    allocate_queue(0, NVME_AQ_DEPTH);
+                if (n) {
+                    descs.emplace_back();
+                    memset(&descs.back(), 0, sizeof(descs.back()));
+                    sgl_set_data(&descs.back(), iov[seg].addr + seg_off, n);
+                }
 
-    auto& nvmeq = queues.front();
-    uint32_t aqa = nvmeq->depth - 1;
-    aqa |= aqa << 16;
+                left -= n;
+                seg_off += n;
+                if (seg_off == iov[seg].len) {
+                    seg++;
+                    seg_off = 0;
+                }
+            }
 
-    uint64_t asq = nvmeq->sq_dma_addr;
-    uint64_t acq = nvmeq->cq_dma_addr;
+            init_rw_command(&cmd, do_write, nsid, pos, cmd_len, lba_shift);
 
-    link->writel((uint64_t)NVME_REG_AQA, aqa);
-    link->writeq((uint64_t)NVME_REG_ASQ, asq);
-    link->writeq((uint64_t)NVME_REG_ACQ, acq);
+            /* The data blocks become an SGL or a PRP list on submission. */
+            submit_child_command(nvmeq, &cmd, 0, 0, descs.data(),
+                                 descs.size(), vreq, callback);
 
-    enable_controller();
+            submitted++;
+            pos += cmd_len;
+            total -= cmd_len;
+        }
+    } catch (...) {
+        unplug();
+        if (!abort_vectored(vreq, submitted)) throw;
+        return;
+    }
 
-    init_queue(0);
+    unplug();
+
+    if (vreq) complete_vectored(vreq, NVME_SC_SUCCESS, {});
 }
 
-void NVMeDriver::setup_io_queues()
+void NVMeDriver::submit_child_command(NVMeQueue* nvmeq,
+                                      struct nvme_command* cmd,
+                                      MemorySpace::Address buf, size_t buflen,
+                                      const struct nvme_sgl_desc* descs,
+                                      size_t ndescs, VectoredRequest* vreq,
+                                      AsyncCommandCallback& callback)
 {
-    int nr_io_queues = queues.size() - 1;
-    int max_qs;
-    NVMeStatus status;
-
-    status = set_queue_count(nr_io_queues);
-    if (status || nr_io_queues == 0) {
-        throw DeviceIOError("Failed to set queue count on device");
+    if (!vreq) {
+        submit_command(nvmeq, cmd, buf, buflen, descs, ndescs,
+                       std::move(callback));
+        return;
     }
 
-    for (int i = queue_count; i <= nr_io_queues; i++) {
-        allocate_queue(i, queue_depth);
+    /* Taken before submission as the command may complete right away. */
+    vreq->pending.fetch_add(1, std::memory_order_relaxed);
+
+    try {
+        submit_command(nvmeq, cmd, buf, buflen, descs, ndescs,
+                       [this, vreq](NVMeStatus status,
+                                    const NVMeResult& result) {
+                           complete_vectored(vreq, status, result);
+                       });
+    } catch (...) {
+        vreq->pending.fetch_sub(1, std::memory_order_relaxed);
+        throw;
     }
+}
 
-    max_qs = std::min(queue_count - 1, (size_t)nr_io_queues);
-
-    for (int i = online_queues; i <= max_qs; i++) {
-        NVMeStatus status;
-
-        status = create_queue(queues[i].get(), i);
-        if (status != NVME_SC_SUCCESS) break;
+bool NVMeDriver::abort_vectored(VectoredRequest* vreq, size_t submitted)
+{
+    if (!submitted) {
+        release_vectored(vreq);
+        return false;
     }
+
+    /* Commands in flight still complete the request, so report the failure
+     * through the callback rather than the caller. */
+    complete_vectored(vreq, NVME_SC_INTERNAL, {});
+    return true;
 }
 
-NVMeDriver::NVMeStatus NVMeDriver::create_queue(NVMeQueue* nvmeq, unsigned qid)
+void NVMeDriver::complete_vectored(VectoredRequest* vreq, NVMeStatus status,
+                                   const NVMeResult& result)
 {
-    NVMeStatus status;
+    if ((status & 0x7ff) != NVME_SC_SUCCESS) {
+        NVMeStatus expected = NVME_SC_SUCCESS;
 
-    status = create_cq(nvmeq, qid, qid);
-    if (status) return status;
+        vreq->status.compare_exchange_strong(expected, status,
+                                             std::memory_order_relaxed);
+    }
 
-    status = create_sq(nvmeq, qid);
-    if (status) return status;
+    if (vreq->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        auto callback = std::move(vreq->callback);
 
-    init_queue(qid);
-    return 0;
+        status = vreq->status.load(std::memory_order_relaxed);
+        release_vectored(vreq);
+        callback(status, result);
+    }
 }
 
-NVMeDriver::NVMeStatus NVMeDriver::create_cq(NVMeQueue* nvmeq, unsigned qid,
-                                             unsigned int vector)
+void NVMeDriver::release_vectored(VectoredRequest* vreq)
 {
-    struct nvme_command c = {0};
-    auto& adminq = queues.front();
-    int flags = NVME_QUEUE_PHYS_CONTIG;
-
-    memset(&c, 0, sizeof(c));
-    c.create_cq.opcode = nvme_admin_create_cq;
-    c.create_cq.prp1 = endian::native_to_little((uint64_t)nvmeq->cq_dma_addr);
-    c.create_cq.cqid = endian::native_to_little(qid);
-    c.create_cq.qsize = endian::native_to_little(nvmeq->depth - 1);
-    c.create_cq.cq_flags = endian::native_to_little(flags);
-    c.create_cq.irq_vector = endian::native_to_little(vector);
+    if (!vreq) return;
 
-    return submit_sync_command(adminq.get(), &c, 0, 0, nullptr);
+    if (vreq->buflen) memory_space->free(vreq->buf, vreq->buflen);
+    delete vreq;
 }
 
-NVMeDriver::NVMeStatus NVMeDriver::create_sq(NVMeQueue* nvmeq, unsigned qid)
+void NVMeDriver::submit_dsm_command(unsigned int nsid, const LBARange* ranges,
+                                    size_t nranges,
+                                    AsyncCommandCallback&& callback)
 {
-    struct nvme_command c = {0};
-    auto& adminq = queues.front();
-    int flags = NVME_QUEUE_PHYS_CONTIG;
+    auto* nvmeq = thread_context().io_queue;
+    unsigned int lba_shift = get_namespace(nsid).lba_shift;
+    size_t lba_mask = (1UL << lba_shift) - 1;
+    std::vector<struct nvme_dsm_range> dsm_ranges;
 
-    memset(&c, 0, sizeof(c));
-    c.create_sq.opcode = nvme_admin_create_sq;
-    c.create_sq.prp1 = endian::native_to_little((uint64_t)nvmeq->sq_dma_addr);
-    c.create_sq.sqid = endian::native_to_little(qid);
-    c.create_sq.qsize = endian::native_to_little(nvmeq->depth - 1);
-    c.create_sq.sq_flags = endian::native_to_little(flags);
-    c.create_sq.cqid = endian::native_to_little(qid);
+    if (!(ctrl_oncs & NVME_CTRL_ONCS_DSM))
+        throw DeviceIOError("Dataset Management not supported");
 
-    return submit_sync_command(adminq.get(), &c, 0, 0, nullptr);
-}
+    for (size_t i = 0; i < nranges; i++) {
+        uint64_t slba = ranges[i].pos >> lba_shift;
+        uint64_t nlb = ranges[i].size >> lba_shift;
 
-NVMeDriver::NVMeStatus NVMeDriver::identify_controller()
-{
-    struct nvme_command c = {0};
-    auto& adminq = queues.front();
-    MemorySpace::Address id_buf;
-    int status;
+        if (((size_t)ranges[i].pos | ranges[i].size) & lba_mask)
+            throw std::invalid_argument("Deallocate range not block aligned");
 
-    memset(&c, 0, sizeof(c));
-    c.identify.opcode = nvme_admin_identify;
-    c.identify.cns = NVME_ID_CNS_CTRL;
+        /* The block count of a range is 32 bits wide. */
+        while (nlb) {
+            uint32_t n = std::min(nlb, (uint64_t)UINT32_MAX);
+            struct nvme_dsm_range range;
 
-    id_buf = memory_space->allocate_pages(sizeof(struct nvme_id_ctrl));
+            range.cattr = 0;
+            range.nlb = endian::native_to_little(n);
+            range.slba = endian::native_to_little(slba);
+            dsm_ranges.push_back(range);
 
-    status = submit_sync_command(adminq.get(), &c, id_buf,
-                                 sizeof(struct nvme_id_ctrl), nullptr);
+            slba += n;
+            nlb -= n;
+        }
+    }
 
-    memory_space->free(id_buf, sizeof(struct nvme_id_ctrl));
+    if (dsm_ranges.empty())
+        throw std::invalid_argument("Empty deallocate range list");
 
-    return status;
-}
+    size_t ncmds =
+        (dsm_ranges.size() + NVME_DSM_MAX_RANGES - 1) / NVME_DSM_MAX_RANGES;
 
-bool NVMeDriver::cqe_pending(NVMeQueue* nvmeq)
-{
-    uint16_t status;
-    struct nvme_completion* cqes = nullptr;
+    spdlog::trace("Submitting deallocate nsid={} ranges={} commands={}", nsid,
+                  dsm_ranges.size(), ncmds);
 
-    assert(nvmeq->cq_head < nvmeq->depth);
-    memory_space->read(nvmeq->cq_dma_addr +
-                           ((uintptr_t)&cqes[nvmeq->cq_head].status),
-                       &status, sizeof(status));
-    endian::little_to_native_inplace(status);
-    return (status & 1) == nvmeq->cq_phase;
-}
+    /* One range list page per command, freed when all of them complete. */
+    size_t list_size = NVME_DSM_MAX_RANGES * sizeof(struct nvme_dsm_range);
+    auto* vreq = new VectoredRequest(std::move(callback));
 
-void NVMeDriver::handle_cqe(NVMeQueue* nvmeq, uint16_t idx)
-{
-    struct nvme_completion cqe;
-    uint16_t command_id;
+    try {
+        vreq->buflen = ncmds * list_size;
+        vreq->buf = memory_space->allocate_pages(vreq->buflen);
+    } catch (...) {
+        vreq->buflen = 0;
+        release_vectored(vreq);
+        throw;
+    }
 
-    assert(idx < nvmeq->depth);
-    memory_space->read(nvmeq->cq_dma_addr + (idx * sizeof(cqe)), &cqe,
-                       sizeof(cqe));
+    memory_space->write(vreq->buf, dsm_ranges.data(),
+                        dsm_ranges.size() * sizeof(struct nvme_dsm_range));
 
-    command_id = cqe.command_id;
+    size_t submitted = 0;
 
-    bool release_cmd = false;
+    plug();
 
-    {
-        std::lock_guard<std::mutex> guard(command_mutex);
-        auto it = command_map.find(command_id);
+    try {
+        for (size_t i = 0; i < dsm_ranges.size(); i += NVME_DSM_MAX_RANGES) {
+            size_t n = std::min(dsm_ranges.size() - i,
+                                (size_t)NVME_DSM_MAX_RANGES);
+            struct nvme_command cmd;
 
-        if (it == command_map.end()) {
-            spdlog::error("Completion queue entry without command id={}",
-                          command_id);
-            return;
-        }
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.dsm.opcode = nvme_cmd_dsm;
+            cmd.dsm.nsid = endian::native_to_little(nsid);
+            cmd.dsm.nr = endian::native_to_little((uint32_t)n - 1);
+            cmd.dsm.attributes =
+                endian::native_to_little((uint32_t)NVME_DSMGMT_AD);
 
-        auto& cmd = it->second;
-        {
-            std::unique_lock<std::mutex> lock(cmd->mutex);
-
-            auto status = endian::little_to_native(cqe.status) >> 1;
-            if (cmd->callback) {
-                cmd->callback(status, cqe.result);
-                release_cmd = true;
-            } else {
-                cmd->status = status;
-                cmd->result = cqe.result;
-                cmd->completed = true;
-
-                cmd->cv.notify_all();
-            }
+            submit_child_command(nvmeq, &cmd,
+                                 vreq->buf + i * sizeof(struct nvme_dsm_range),
+                                 n * sizeof(struct nvme_dsm_range), nullptr, 0,
+                                 vreq, callback);
+            submitted++;
         }
+    } catch (...) {
+        unplug();
+        if (!abort_vectored(vreq, submitted)) throw;
+        return;
     }
 
-    if (release_cmd) remove_async_command(command_id);
+    unplug();
+
+    complete_vectored(vreq, NVME_SC_SUCCESS, {});
 }
 
-void NVMeDriver::nvme_irq(NVMeQueue* nvmeq)
+void NVMeDriver::submit_write_zeroes_command(unsigned int nsid, loff_t pos,
+                                             size_t size,
+                                             AsyncCommandCallback&& callback)
 {
-    int found = 0;
+    auto* nvmeq = thread_context().io_queue;
+    unsigned int lba_shift = get_namespace(nsid).lba_shift;
+    size_t lba_mask = (1UL << lba_shift) - 1;
 
-    while (cqe_pending(nvmeq)) {
-        found++;
-        handle_cqe(nvmeq, nvmeq->cq_head);
-        nvmeq->update_cq_head();
-    }
+    if (!(ctrl_oncs & NVME_CTRL_ONCS_WRITE_ZEROES))
+        throw DeviceIOError("Write Zeroes not supported");
 
-    if (found) ring_cq_doorbell(nvmeq);
-}
+    if (!size || (((size_t)pos | size) & lba_mask))
+        throw std::invalid_argument("Write zeroes range not block aligned");
 
-NVMeDriver::AsyncCommand*
-NVMeDriver::submit_rw_command(bool do_write, unsigned int nsid, loff_t pos,
-                              MemorySpace::Address buf, size_t size,
-                              AsyncCommandCallback&& callback)
-{
-    uint16_t control = 0;
-    uint32_t dsmgmt = 0;
-    struct nvme_command cmd;
+    uint64_t slba = pos >> lba_shift;
+    uint64_t nlb = size >> lba_shift;
+    size_t ncmds = (nlb + MAX_RW_BLOCKS - 1) / MAX_RW_BLOCKS;
 
-    spdlog::trace("Submitting {} command pos={} size={}",
-                  do_write ? "write" : "read", pos, size);
+    spdlog::trace("Submitting write zeroes nsid={} pos={} size={}", nsid, pos,
+                  size);
 
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.rw.opcode = (do_write ? nvme_cmd_write : nvme_cmd_read);
-    cmd.rw.nsid = endian::native_to_little(nsid);
-    cmd.rw.slba = endian::native_to_little(pos >> 12);
-    cmd.rw.length = endian::native_to_little((size >> 12) - 1);
+    VectoredRequest* vreq = nullptr;
+    if (ncmds > 1) vreq = new VectoredRequest(std::move(callback));
 
-    cmd.rw.control = endian::native_to_little(control);
-    cmd.rw.dsmgmt = endian::native_to_little(dsmgmt);
+    size_t submitted = 0;
 
-    return submit_async_command(thread_io_queue, &cmd, buf, size,
-                                std::move(callback));
+    plug();
+
+    try {
+        while (nlb) {
+            uint32_t n = std::min(nlb, (uint64_t)MAX_RW_BLOCKS);
+            struct nvme_command cmd;
+
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.write_zeroes.opcode = nvme_cmd_write_zeroes;
+            cmd.write_zeroes.nsid = endian::native_to_little(nsid);
+            cmd.write_zeroes.slba = endian::native_to_little(slba);
+            cmd.write_zeroes.length =
+                endian::native_to_little((uint16_t)(n - 1));
+
+            submit_child_command(nvmeq, &cmd, 0, 0, nullptr, 0, vreq,
+                                 callback);
+            submitted++;
+
+            slba += n;
+            nlb -= n;
+        }
+    } catch (...) {
+        unplug();
+        if (!abort_vectored(vreq, submitted)) throw;
+        return;
+    }
+
+    unplug();
+
+    if (vreq) complete_vectored(vreq, NVME_SC_SUCCESS, {});
 }
 
 NVMeDriver::AsyncCommand*
@@ -648,15 +3105,55 @@ NVMeDriver::submit_flush_command(unsigned int nsid,
     cmd.rw.opcode = nvme_cmd_flush;
     cmd.rw.nsid = endian::native_to_little(nsid);
 
-    return submit_async_command(thread_io_queue, &cmd, 0, 0,
+    return submit_async_command(thread_context().io_queue, &cmd, 0, 0,
                                 std::move(callback));
 }
 
+NVMeDriver::NVMeStatus NVMeDriver::submit_rw_sync(bool do_write,
+                                                  unsigned int nsid,
+                                                  loff_t pos,
+                                                  MemorySpace::Address buf,
+                                                  size_t size)
+{
+    size_t lba_mask = (1UL << get_namespace(nsid).lba_shift) - 1;
+
+    if (size <= max_transfer_size || (((size_t)pos | size) & lba_mask))
+        return submit_rw_command(do_write, nsid, pos, buf, size, {})
+            ->wait(nullptr);
+
+    /* Keep sub-commands in flight, but no more than the queue has slots
+     * for: a synchronous command holds its slot until it is waited on, so
+     * the oldest is reaped before another one is issued. */
+    size_t max_inflight = thread_context().io_queue->depth - 1;
+    std::deque<AsyncCommand*> cmds;
+    NVMeStatus status = NVME_SC_SUCCESS;
+
+    auto wait_oldest = [&cmds, &status]() {
+        auto cmd_status = cmds.front()->wait(nullptr);
+
+        if ((status & 0x7ff) == NVME_SC_SUCCESS) status = cmd_status;
+        cmds.pop_front();
+    };
+
+    for (size_t off = 0; off < size; off += max_transfer_size) {
+        size_t len = std::min(size - off, max_transfer_size);
+
+        if (cmds.size() >= max_inflight) wait_oldest();
+
+        cmds.push_back(
+            submit_rw_command(do_write, nsid, pos + off, buf + off, len, {}));
+    }
+
+    while (!cmds.empty())
+        wait_oldest();
+
+    return status;
+}
+
 void NVMeDriver::read(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
                       size_t size)
 {
-    auto cmd = submit_rw_command(false, nsid, pos, buf, size, {});
-    auto status = cmd->wait(nullptr);
+    auto status = submit_rw_sync(false, nsid, pos, buf, size);
     if ((status & 0x7ff) == NVME_SC_SUCCESS) return;
 
     throw DeviceIOError("Read command error");
@@ -665,8 +3162,7 @@ void NVMeDriver::read(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
 void NVMeDriver::write(unsigned int nsid, loff_t pos, MemorySpace::Address buf,
                        size_t size)
 {
-    auto cmd = submit_rw_command(false, nsid, pos, buf, size, {});
-    auto status = cmd->wait(nullptr);
+    auto status = submit_rw_sync(true, nsid, pos, buf, size);
     if ((status & 0x7ff) == NVME_SC_SUCCESS) return;
 
     throw DeviceIOError("Write command error");
@@ -732,7 +3228,7 @@ NVMeDriver::submit_invoke_command(unsigned int cid, MemorySpace::Address entry,
     cmd.storpu_invoke.arg = endian::native_to_little((uint64_t)arg);
     cmd.storpu_invoke.cid = endian::native_to_little((uint32_t)cid);
 
-    return submit_async_command(thread_io_queue, &cmd, 0, 0,
+    return submit_async_command(thread_context().io_queue, &cmd, 0, 0,
                                 std::move(callback));
 }
 
@@ -801,6 +3297,8 @@ void NVMeDriver::delete_namespace(unsigned int nsid)
     status = submit_ns_mgmt(nsid, 1, 0, 0, nullptr);
 
     check_status(status & 0x7ff);
+
+    invalidate_namespace(nsid);
 }
 
 NVMeDriver::NVMeStatus NVMeDriver::submit_ns_attach(unsigned int nsid, int sel,
@@ -841,6 +3339,8 @@ void NVMeDriver::attach_namespace(unsigned int nsid)
     delete[] ctrl_list;
 
     check_status(status & 0x7ff);
+
+    identify_namespace(nsid);
 }
 
 void NVMeDriver::detach_namespace(unsigned int nsid)
@@ -863,4 +3363,6 @@ void NVMeDriver::detach_namespace(unsigned int nsid)
     delete[] ctrl_list;
 
     check_status(status & 0x7ff);
+
+    invalidate_namespace(nsid);
 }
@@ -1,4 +1,5 @@
 #include "libunvme/pcie_link_mcmq.h"
+#include "libunvme/tracer.h"
 #include "ringbuffer.h"
 
 #include "spdlog/spdlog.h"
@@ -25,7 +26,7 @@ bool PCIeLinkMcmq::init()
     struct sockaddr_vm addr;
     memset(&addr, 0, sizeof(struct sockaddr_vm));
     addr.svm_family = AF_VSOCK;
-    addr.svm_port = 9999;
+    addr.svm_port = port;
     addr.svm_cid = VMADDR_CID_HOST;
 
     retval =
@@ -72,7 +73,7 @@ void PCIeLinkMcmq::send_message(MessageType type, uint64_t addr,
 
     if (buf) ::memcpy(&msg[12], buf, len);
 
-    spdlog::trace("Sending PCIe message addr={} buf={} len={}", addr, buf, len);
+    UNVME_TRACE_EVENT(LINK_SEND, 0, len, (uint64_t)type, addr);
     {
         std::lock_guard<std::mutex> guard(sock_mutex);
 
@@ -261,6 +262,8 @@ void PCIeLinkMcmq::recv_thread()
                     len -= sizeof(type);
                     offset += sizeof(type);
 
+                    UNVME_TRACE_EVENT(LINK_RECV, 0, len, type);
+
                     switch (type) {
                     case (int)MessageType::READ_COMP:
                         assert(len >= sizeof(id));
@@ -268,10 +271,6 @@ void PCIeLinkMcmq::recv_thread()
                         len -= sizeof(id);
                         offset += sizeof(id);
 
-                        spdlog::trace(
-                            "Receive read complete message id={} len={}", id,
-                            len);
-
                         complete_read_request(id, &payload[offset], len);
                         break;
                     case (int)MessageType::IRQ:
@@ -280,8 +279,6 @@ void PCIeLinkMcmq::recv_thread()
                         len -= sizeof(vector);
                         offset += sizeof(vector);
 
-                        spdlog::trace("Receive IRQ message vector={}", vector);
-
                         if (irq_handler) irq_handler(vector);
                         break;
                     case (int)MessageType::DEV_READY: {
@@ -157,6 +157,31 @@ MemorySpace* PCIeLinkVfio::map_bar(unsigned int bar_id)
     return new BARMemorySpace(bar_base, bar_size);
 }
 
+uint64_t PCIeLinkVfio::get_bar_address(unsigned int bar_id)
+{
+    uint32_t lo, hi = 0;
+    struct vfio_region_info reg = {.argsz = sizeof(reg)};
+    reg.index = VFIO_PCI_CONFIG_REGION_INDEX;
+
+    ioctl(device_fd, VFIO_DEVICE_GET_REGION_INFO, &reg);
+
+    /* Base address registers start at 0x10 in the configuration space. */
+    if (pread(device_fd, &lo, sizeof(lo), reg.offset + 0x10 + bar_id * 4) !=
+        sizeof(lo))
+        return 0;
+
+    /* I/O BAR */
+    if (lo & 0x1) return 0;
+
+    /* 64-bit memory BAR */
+    if ((lo & 0x6) == 0x4 &&
+        pread(device_fd, &hi, sizeof(hi), reg.offset + 0x14 + bar_id * 4) !=
+            sizeof(hi))
+        return 0;
+
+    return ((uint64_t)hi << 32) | (lo & ~0xfU);
+}
+
 size_t PCIeLinkVfio::read_from_device(uint64_t addr, void* buf, size_t buflen)
 {
     uint32_t lo, hi;
@@ -0,0 +1,348 @@
+#include "libunvme/striped_volume.h"
+
+#include "spdlog/spdlog.h"
+
+#include <climits>
+#include <stdexcept>
+
+using NVMeStatus = NVMeDriver::NVMeStatus;
+using NVMeResult = NVMeDriver::NVMeResult;
+
+static void copy_memory(MemorySpace* dst, MemorySpace::Address dst_addr,
+                        MemorySpace* src, MemorySpace::Address src_addr,
+                        size_t len)
+{
+    size_t n = len;
+    const void* ptr = src->get_raw_ptr(src_addr, n);
+
+    if (!ptr || n < len)
+        throw std::invalid_argument("Buffer outside of memory space");
+
+    dst->write(dst_addr, ptr, len);
+}
+
+StripedVolume::StripedVolume(const std::vector<Member>& members,
+                             size_t stripe_size)
+    : members(members), stripe_size(stripe_size), block_size(0), capacity(0)
+{
+    size_t member_size = SIZE_MAX;
+
+    if (members.empty())
+        throw std::invalid_argument("Striped volume without members");
+
+    for (size_t i = 0; i < members.size(); i++) {
+        auto& member = members[i];
+        auto info = member.driver->get_namespace_info(member.nsid);
+        size_t lba_size = 1UL << info.lba_shift;
+
+        if (!stripe_size || stripe_size % lba_size)
+            throw std::invalid_argument(
+                "Stripe size not a multiple of the block size");
+
+        block_size = std::max(block_size, lba_size);
+        member_size = std::min(member_size, info.nsze << info.lba_shift);
+
+        shared_memory.push_back(member.driver->get_memory_space() ==
+                                get_memory_space());
+        if (!shared_memory.back())
+            spdlog::warn("Volume member {} has a separate memory space, "
+                         "using bounce buffers",
+                         i);
+    }
+
+    capacity = member_size / stripe_size * stripe_size * members.size();
+
+    spdlog::info("Striped volume: {} members, stripe size {}, capacity {}",
+                 members.size(), stripe_size, capacity);
+}
+
+bool StripedVolume::supports_deallocate() const
+{
+    for (auto&& member : members)
+        if (!member.driver->supports_deallocate()) return false;
+
+    return true;
+}
+
+void StripedVolume::set_thread_id(unsigned int thread_id)
+{
+    for (auto&& member : members)
+        member.driver->set_thread_id(thread_id);
+}
+
+unsigned int StripedVolume::poll_completions()
+{
+    unsigned int found = 0;
+
+    for (auto&& member : members) {
+        unsigned int qid = member.driver->get_thread_queue();
+
+        if (qid && member.driver->get_completion_mode(qid) !=
+                       NVMeDriver::CompletionMode::INTERRUPT)
+            found += member.driver->poll_completions();
+    }
+
+    return found;
+}
+
+void StripedVolume::plug()
+{
+    for (auto&& member : members)
+        member.driver->plug();
+}
+
+void StripedVolume::unplug()
+{
+    for (auto&& member : members)
+        member.driver->unplug();
+}
+
+void StripedVolume::check_range(loff_t pos, size_t size) const
+{
+    if (pos < 0 || (size_t)pos > capacity || size > capacity - pos)
+        throw std::invalid_argument("Request beyond the end of the volume");
+}
+
+template <typename Submit>
+void StripedVolume::submit_child(StripeRequest* sreq, Submit&& submit)
+{
+    /* Taken before submission as the command may complete right away. */
+    sreq->pending.fetch_add(1, std::memory_order_relaxed);
+
+    try {
+        submit();
+    } catch (...) {
+        sreq->pending.fetch_sub(1, std::memory_order_relaxed);
+        throw;
+    }
+}
+
+void StripedVolume::submit_rw(bool do_write, loff_t pos,
+                              MemorySpace::Address buf, size_t size,
+                              AsyncCommandCallback&& callback)
+{
+    loff_t member_pos;
+
+    check_range(pos, size);
+
+    unsigned int idx = map_position(pos, member_pos);
+
+    /* A request within one stripe goes to its member directly. */
+    if (pos % stripe_size + size <= stripe_size && shared_memory[idx]) {
+        auto& member = members[idx];
+
+        if (do_write)
+            member.driver->write_async(member.nsid, member_pos, buf, size,
+                                       std::move(callback));
+        else
+            member.driver->read_async(member.nsid, member_pos, buf, size,
+                                      std::move(callback));
+        return;
+    }
+
+    auto* sreq = new StripeRequest(std::move(callback));
+    size_t submitted = 0;
+
+    plug();
+
+    try {
+        while (size) {
+            size_t len = std::min(size, stripe_size - pos % stripe_size);
+
+            idx = map_position(pos, member_pos);
+            submit_part(sreq, do_write, idx, member_pos, buf, len);
+
+            submitted++;
+            pos += len;
+            buf += len;
+            size -= len;
+        }
+    } catch (...) {
+        unplug();
+        if (!abort_stripe(sreq, submitted)) throw;
+        return;
+    }
+
+    unplug();
+
+    complete_stripe(sreq, NVME_SC_SUCCESS);
+}
+
+void StripedVolume::submit_part(StripeRequest* sreq, bool do_write,
+                                unsigned int idx, loff_t pos,
+                                MemorySpace::Address buf, size_t size)
+{
+    auto& member = members[idx];
+
+    if (shared_memory[idx]) {
+        submit_child(sreq, [&]() {
+            auto callback = [sreq](NVMeStatus status, const NVMeResult&) {
+                complete_stripe(sreq, status);
+            };
+
+            if (do_write)
+                member.driver->write_async(member.nsid, pos, buf, size,
+                                           std::move(callback));
+            else
+                member.driver->read_async(member.nsid, pos, buf, size,
+                                          std::move(callback));
+        });
+        return;
+    }
+
+    auto* bounce_space = member.driver->get_memory_space();
+    auto* memory_space = get_memory_space();
+    auto bounce = bounce_space->allocate_pages(size);
+
+    try {
+        if (do_write)
+            copy_memory(bounce_space, bounce, memory_space, buf, size);
+
+        submit_child(sreq, [&]() {
+            auto callback = [sreq, do_write, memory_space, buf, bounce_space,
+                             bounce, size](NVMeStatus status,
+                                           const NVMeResult&) {
+                /* Runs on the driver's completion thread: report a failed
+                 * copy through the status instead of throwing. */
+                if (!do_write && (status & 0x7ff) == NVME_SC_SUCCESS) {
+                    try {
+                        copy_memory(memory_space, buf, bounce_space, bounce,
+                                    size);
+                    } catch (const std::invalid_argument&) {
+                        status = NVME_SC_INTERNAL;
+                    }
+                }
+
+                bounce_space->free(bounce, size);
+                complete_stripe(sreq, status);
+            };
+
+            if (do_write)
+                member.driver->write_async(member.nsid, pos, bounce, size,
+                                           std::move(callback));
+            else
+                member.driver->read_async(member.nsid, pos, bounce, size,
+                                          std::move(callback));
+        });
+    } catch (...) {
+        bounce_space->free(bounce, size);
+        throw;
+    }
+}
+
+void StripedVolume::deallocate_async(const NVMeDriver::LBARange* ranges,
+                                     size_t nranges,
+                                     AsyncCommandCallback&& callback)
+{
+    std::vector<std::vector<NVMeDriver::LBARange>> member_ranges(
+        members.size());
+
+    /* Consecutive stripes of a member are adjacent on the member, so a
+     * range spanning several rows maps to one range per member. */
+    for (size_t i = 0; i < nranges; i++) {
+        loff_t pos = ranges[i].pos;
+        size_t size = ranges[i].size;
+
+        check_range(pos, size);
+
+        while (size) {
+            size_t len = std::min(size, stripe_size - pos % stripe_size);
+            loff_t member_pos;
+            auto& list = member_ranges[map_position(pos, member_pos)];
+
+            if (!list.empty() &&
+                list.back().pos + (loff_t)list.back().size == member_pos)
+                list.back().size += len;
+            else
+                list.push_back({member_pos, len});
+
+            pos += len;
+            size -= len;
+        }
+    }
+
+    auto* sreq = new StripeRequest(std::move(callback));
+    size_t submitted = 0;
+
+    plug();
+
+    try {
+        for (size_t i = 0; i < members.size(); i++) {
+            auto& member = members[i];
+            auto& list = member_ranges[i];
+
+            if (list.empty()) continue;
+
+            submit_child(sreq, [&]() {
+                member.driver->deallocate_async(
+                    member.nsid, list.data(), list.size(),
+                    [sreq](NVMeStatus status, const NVMeResult&) {
+                        complete_stripe(sreq, status);
+                    });
+            });
+            submitted++;
+        }
+    } catch (...) {
+        unplug();
+        if (!abort_stripe(sreq, submitted)) throw;
+        return;
+    }
+
+    unplug();
+
+    complete_stripe(sreq, NVME_SC_SUCCESS);
+}
+
+void StripedVolume::flush_async(AsyncCommandCallback&& callback)
+{
+    auto* sreq = new StripeRequest(std::move(callback));
+    size_t submitted = 0;
+
+    try {
+        for (auto&& member : members) {
+            submit_child(sreq, [&]() {
+                member.driver->flush_async(
+                    member.nsid, [sreq](NVMeStatus status, const NVMeResult&) {
+                        complete_stripe(sreq, status);
+                    });
+            });
+            submitted++;
+        }
+    } catch (...) {
+        if (!abort_stripe(sreq, submitted)) throw;
+        return;
+    }
+
+    complete_stripe(sreq, NVME_SC_SUCCESS);
+}
+
+bool StripedVolume::abort_stripe(StripeRequest* sreq, size_t submitted)
+{
+    if (!submitted) {
+        delete sreq;
+        return false;
+    }
+
+    /* Parts in flight still complete the request, so report the failure
+     * through the callback rather than the caller. */
+    complete_stripe(sreq, NVME_SC_INTERNAL);
+    return true;
+}
+
+void StripedVolume::complete_stripe(StripeRequest* sreq, NVMeStatus status)
+{
+    if ((status & 0x7ff) != NVME_SC_SUCCESS) {
+        NVMeStatus expected = NVME_SC_SUCCESS;
+
+        sreq->status.compare_exchange_strong(expected, status,
+                                             std::memory_order_relaxed);
+    }
+
+    if (sreq->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        auto callback = std::move(sreq->callback);
+
+        status = sreq->status.load(std::memory_order_relaxed);
+        delete sreq;
+        callback(status, {});
+    }
+}
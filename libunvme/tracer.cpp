@@ -0,0 +1,158 @@
+#include "libunvme/tracer.h"
+
+#include "spdlog/spdlog.h"
+
+#include <fstream>
+#include <iomanip>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct EventFormat {
+    const char* name;
+    const char* qid;
+    const char* id;
+    const char* arg0;
+    const char* arg1;
+};
+
+static const EventFormat event_formats[] = {
+    {"submit", "qid", "cid", "opcode", "nsid"},
+    {"sq_doorbell", "qid", nullptr, "tail", "mmio"},
+    {"cq_doorbell", "qid", nullptr, "head", nullptr},
+    {"irq", "vector", nullptr, "cqes", nullptr},
+    {"cqe", "qid", "cid", "status", nullptr},
+    {"callbacks", "qid", nullptr, "count", nullptr},
+    {"callbacks", nullptr, nullptr, nullptr, nullptr},
+    {"link_send", nullptr, "len", "type", "addr"},
+    {"link_recv", nullptr, "len", "type", nullptr},
+    {"mem_read", nullptr, "len", "addr", nullptr},
+    {"mem_write", nullptr, "len", "addr", nullptr},
+};
+
+static_assert(sizeof(event_formats) / sizeof(event_formats[0]) ==
+                  (size_t)Tracer::EventType::NR_TYPES,
+              "Missing trace event format");
+
+thread_local Tracer::Ring* Tracer::thread_ring = nullptr;
+std::mutex Tracer::ring_mutex;
+std::vector<std::unique_ptr<Tracer::Ring>> Tracer::rings;
+
+/* Timestamp and wall clock at the first event, to convert TSC ticks. */
+static uint64_t base_timestamp;
+static std::chrono::steady_clock::time_point base_time;
+
+Tracer::Ring* Tracer::register_thread()
+{
+    auto ring = std::make_unique<Ring>();
+
+    ring->tid = syscall(SYS_gettid);
+    ring->head.store(0, std::memory_order_relaxed);
+    thread_ring = ring.get();
+
+    std::lock_guard<std::mutex> lock(ring_mutex);
+
+    if (rings.empty()) {
+        base_time = std::chrono::steady_clock::now();
+        base_timestamp = timestamp();
+    }
+
+    rings.push_back(std::move(ring));
+    return thread_ring;
+}
+
+static void write_arg(std::ofstream& out, const char* name, uint64_t value,
+                      bool& first)
+{
+    if (!name) return;
+
+    out << (first ? "" : ",") << '"' << name << "\":" << value;
+    first = false;
+}
+
+bool Tracer::export_chrome_trace(const std::filesystem::path& filename)
+{
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    std::ofstream out(filename);
+
+    if (!out) {
+        spdlog::error("Failed to open trace file {}", filename.string());
+        return false;
+    }
+
+    /* Timestamp ticks per microsecond. */
+    double ticks_per_us = 1000.0;
+
+    if (!rings.empty()) {
+        std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - base_time;
+        uint64_t ticks = timestamp() - base_timestamp;
+
+        if (elapsed.count() > 0) ticks_per_us = ticks / elapsed.count();
+    }
+
+    size_t count = 0;
+    bool first_event = true;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    out << std::fixed << std::setprecision(3);
+
+    for (auto&& ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t tail = head > RING_SIZE ? head - RING_SIZE : 0;
+
+        if (!first_event) out << ",";
+        first_event = false;
+
+        out << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << ring->tid << ",\"args\":{\"name\":\"thread " << ring->tid
+            << "\"}}";
+
+        for (uint64_t i = tail; i < head; i++) {
+            const auto& event = ring->events[i & (RING_SIZE - 1)];
+            const auto& format = event_formats[(size_t)event.type];
+            double ts = (int64_t)(event.timestamp - base_timestamp) /
+                        ticks_per_us;
+            bool first_arg = true;
+
+            out << ",\n{\"name\":\"";
+
+            switch (event.type) {
+            case EventType::SUBMIT:
+            case EventType::CQE:
+                /* Pair submission and completion of a command slot. */
+                out << "command\",\"cat\":\"nvme\",\"ph\":\""
+                    << (event.type == EventType::SUBMIT ? 'b' : 'e')
+                    << "\",\"id\":\"" << event.qid << "." << event.id
+                    << "\"";
+                break;
+            case EventType::CALLBACK_BEGIN:
+            case EventType::CALLBACK_END:
+                out << format.name << "\",\"ph\":\""
+                    << (event.type == EventType::CALLBACK_BEGIN ? 'B' : 'E')
+                    << "\"";
+                break;
+            default:
+                out << format.name << "\",\"ph\":\"i\",\"s\":\"t\"";
+                break;
+            }
+
+            out << ",\"pid\":1,\"tid\":" << ring->tid << ",\"ts\":" << ts
+                << ",\"args\":{";
+            write_arg(out, format.qid, event.qid, first_arg);
+            write_arg(out, format.id, event.id, first_arg);
+            write_arg(out, format.arg0, event.arg0, first_arg);
+            write_arg(out, format.arg1, event.arg1, first_arg);
+            out << "}}";
+
+            count++;
+        }
+    }
+
+    out << "\n]}\n";
+
+    spdlog::info("Exported {} trace events from {} threads to {}", count,
+                 rings.size(), filename.string());
+
+    return out.good();
+}
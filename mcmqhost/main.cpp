@@ -1,10 +1,13 @@
 #include "libmcmq/config_reader.h"
 #include "libmcmq/io_thread_synthetic.h"
 #include "libmcmq/result_exporter.h"
+#include "libmcmq/telemetry_sampler.h"
 #include "libunvme/memory_space.h"
 #include "libunvme/nvme_driver.h"
 #include "libunvme/pcie_link_mcmq.h"
 #include "libunvme/pcie_link_vfio.h"
+#include "libunvme/striped_volume.h"
+#include "libunvme/tracer.h"
 
 #include "cxxopts.hpp"
 #include "spdlog/cfg/env.h"
@@ -22,18 +25,23 @@ cxxopts::ParseResult parse_arguments(int argc, char* argv[])
         // clang-format off
         options.add_options()
             ("b,backend", "Backend type", cxxopts::value<std::string>()->default_value("mcmq"))
-            ("m,memory", "Path to the shared memory file",
-            cxxopts::value<std::string>()->default_value("/dev/shm/ivshmem"))
+            ("m,memory", "Path to the shared memory file, once per device",
+            cxxopts::value<std::vector<std::string>>()->default_value("/dev/shm/ivshmem"))
             ("c,config", "Path to the SSD config file",
             cxxopts::value<std::string>()->default_value("ssdconfig.yaml"))
             ("w,workload", "Path to the workload file",
             cxxopts::value<std::string>()->default_value("workload.yaml"))
             ("r,result", "Path to the result file",
             cxxopts::value<std::string>()->default_value("result.json"))
-            ("g,group", "VFIO group",
-            cxxopts::value<std::string>())
-            ("d,device", "PCI device ID",
+            ("g,group", "VFIO group, once per device",
+            cxxopts::value<std::vector<std::string>>())
+            ("d,device", "PCI device ID, once per device",
+            cxxopts::value<std::vector<std::string>>())
+            ("dbbuf", "Use shadow doorbells with EventIdx")
+            ("t,trace", "Path to the Chrome trace file (needs UNVME_TRACE)",
             cxxopts::value<std::string>())
+            ("l,library", "Storage function library to invoke instead of "
+            "running the workload", cxxopts::value<std::string>())
             ("h,help", "Print help");
         // clang-format on
 
@@ -50,6 +58,60 @@ cxxopts::ParseResult parse_arguments(int argc, char* argv[])
     }
 }
 
+static NVMeDriver::QueuePriority get_queue_priority(QueuePriority prio)
+{
+    switch (prio) {
+    case QueuePriority::URGENT:
+        return NVMeDriver::QueuePriority::URGENT;
+    case QueuePriority::HIGH:
+        return NVMeDriver::QueuePriority::HIGH;
+    case QueuePriority::LOW:
+        return NVMeDriver::QueuePriority::LOW;
+    default:
+        return NVMeDriver::QueuePriority::MEDIUM;
+    }
+}
+
+static NVMeDriver::CompletionMode get_completion_mode(CompletionMode mode)
+{
+    switch (mode) {
+    case CompletionMode::POLL:
+        return NVMeDriver::CompletionMode::POLL;
+    case CompletionMode::HYBRID:
+        return NVMeDriver::CompletionMode::HYBRID;
+    default:
+        return NVMeDriver::CompletionMode::INTERRUPT;
+    }
+}
+
+static void configure_driver(NVMeDriver& driver, const HostConfig& host_config)
+{
+    driver.set_batch_completion_callback(IOThread::complete_requests);
+    driver.set_irq_coalescing(host_config.irq_coalescing_threshold,
+                              host_config.irq_coalescing_time);
+
+    if (host_config.wrr_arbitration)
+        driver.set_arbitration(host_config.high_priority_weight,
+                               host_config.medium_priority_weight,
+                               host_config.low_priority_weight,
+                               host_config.arbitration_burst);
+
+    driver.set_command_timeout(host_config.command_timeout);
+    driver.set_read_hedging(host_config.hedge_percentile);
+    driver.set_queue_latency_stats(host_config.queue_latency_stats);
+    driver.set_lazy_queue_creation(host_config.lazy_queue_creation);
+    driver.set_cmb_submission_queues(host_config.cmb_submission_queues);
+
+    for (size_t i = 0; i < host_config.flows.size(); i++) {
+        driver.set_completion_mode(
+            i + 1, get_completion_mode(host_config.flows[i].completion_mode));
+        driver.set_irq_coalescing_disabled(
+            i + 1, !host_config.flows[i].irq_coalescing);
+        driver.set_queue_priority(
+            i + 1, get_queue_priority(host_config.flows[i].priority));
+    }
+}
+
 //int main(int argc, char* argv[])
 //{
 //    spdlog::cfg::load_env_levels();
@@ -250,117 +312,217 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
 
-    std::unique_ptr<MemorySpace> memory_space;
-    std::unique_ptr<PCIeLink> link;
+    std::vector<std::unique_ptr<MemorySpace>> memory_spaces;
+    std::vector<std::unique_ptr<PCIeLink>> links;
+    /* Memory space each device does DMA to. */
+    std::vector<MemorySpace*> device_memory;
 
     if (backend == "mcmq") {
-        std::string shared_memory;
+        std::vector<std::string> shared_memory;
 
         try {
-            shared_memory = args["memory"].as<std::string>();
+            shared_memory = args["memory"].as<std::vector<std::string>>();
         } catch (const OptionException& e) {
             spdlog::error("Failed to parse options: {}", e.what());
             exit(EXIT_FAILURE);
         }
 
-        memory_space = std::make_unique<SharedMemorySpace>(shared_memory);
-        link = std::make_unique<PCIeLinkMcmq>();
+        /* One simulator per shared memory file, each listening on the next
+         * vsock port. */
+        for (size_t i = 0; i < shared_memory.size(); i++) {
+            memory_spaces.push_back(
+                std::make_unique<SharedMemorySpace>(shared_memory[i]));
+            links.push_back(std::make_unique<PCIeLinkMcmq>(9999 + i));
+            device_memory.push_back(memory_spaces.back().get());
+        }
     } else if (backend == "vfio") {
-        std::string group, device_id;
+        std::vector<std::string> groups, device_ids;
 
         try {
-            group = args["group"].as<std::string>();
-            device_id = args["device"].as<std::string>();
+            groups = args["group"].as<std::vector<std::string>>();
+            device_ids = args["device"].as<std::vector<std::string>>();
         } catch (const OptionException& e) {
             spdlog::error("Failed to parse options: {}", e.what());
             exit(EXIT_FAILURE);
         }
 
-        memory_space =
-            std::make_unique<VfioMemorySpace>(0x1000, 2 * 1024 * 1024);
-        link = std::make_unique<PCIeLinkVfio>(group, device_id);
+        if (groups.size() != device_ids.size()) {
+            spdlog::error("Expected one VFIO group per device");
+            exit(EXIT_FAILURE);
+        }
+
+        /* All devices share one DMA memory space. */
+        memory_spaces.push_back(
+            std::make_unique<VfioMemorySpace>(0x1000, 2 * 1024 * 1024));
+
+        for (size_t i = 0; i < groups.size(); i++) {
+            links.push_back(
+                std::make_unique<PCIeLinkVfio>(groups[i], device_ids[i]));
+            device_memory.push_back(memory_spaces.front().get());
+        }
     } else {
         spdlog::error("Unknown backend type: {}", backend);
         return EXIT_FAILURE;
     }
 
-    if (!link->init()) {
-        spdlog::error("Failed to initialize PCIe link");
-        return EXIT_FAILURE;
-    }
+    std::vector<std::unique_ptr<NVMeDriver>> drivers;
 
-    link->map_dma(*memory_space);
-    link->start();
-
-    NVMeDriver driver(host_config.flows.size(), host_config.io_queue_depth,
-                      link.get(), memory_space.get(), false);
-    link->send_config(ssd_config);
-    driver.start();
-
-#if 1
-    unsigned int ctx = driver.create_context(
-        "/home/lxz/lemon/bin/libtest.so");
-    spdlog::info("Created context {}", ctx);
-
-    // a host memory to communicate with flash page
-    auto buffer = memory_space->allocate_pages(0x4000); // 16KB
-    spdlog::info("allocate_pages");
-    struct {
-        unsigned long fd;
-        unsigned long host_addr;
-        unsigned long flash_addr;
-        unsigned long length;
-    } lda{} ;
-
-    auto* scratchpad = driver.get_scratchpad();
-    spdlog::info("get_scratchpad");
-    auto argbuf = scratchpad->allocate(sizeof(lda));
-    spdlog::info("scratchpad->allocate");
-    driver.set_thread_id(1);
-    driver.invoke_function(ctx, 0x1630, argbuf); // test vector
-    memory_space->free_pages(buffer, 0x4000);
-
-#else
-    int thread_id = 1;
-    std::vector<std::unique_ptr<IOThread>> io_threads;
-    for (auto&& flow : host_config.flows) {
-        auto it = host_config.namespaces.find(flow.nsid);
-        if (it == host_config.namespaces.end()) {
-            spdlog::error("Unknown namespace {} for flow {}", flow.nsid,
-                          thread_id);
+    for (size_t i = 0; i < links.size(); i++) {
+        if (!links[i]->init()) {
+            spdlog::error("Failed to initialize PCIe link {}", i);
             return EXIT_FAILURE;
         }
 
-        const auto& ns = it->second;
+        links[i]->map_dma(*device_memory[i]);
+        links[i]->start();
+
+        drivers.push_back(std::make_unique<NVMeDriver>(
+            host_config.flows.size(), host_config.io_queue_depth,
+            links[i].get(), device_memory[i], args.count("dbbuf")));
+        configure_driver(*drivers.back(), host_config);
+    }
+
+    /* Plain flows, telemetry and the simulator report use the first
+     * device. */
+    auto& driver = *drivers.front();
+    auto* memory_space = device_memory.front();
 
-        io_threads.emplace_back(IOThread::create_thread(
-            &driver, memory_space.get(), thread_id, host_config.io_queue_depth,
-            host_config.sector_size, ns.capacity_sects, flow));
+    /* Registers for asynchronous events, so it must exist before start(). */
+    TelemetrySampler telemetry(&driver, host_config.telemetry_interval);
 
-        thread_id++;
+    for (size_t i = 0; i < links.size(); i++) {
+        links[i]->send_config(ssd_config);
+        drivers[i]->start();
     }
 
-    for (auto&& thread : io_threads)
-        thread->run();
+    if (args.count("library")) {
+        unsigned int ctx =
+            driver.create_context(args["library"].as<std::string>());
+        spdlog::info("Created context {}", ctx);
+
+        // a host memory to communicate with flash page
+        auto buffer = memory_space->allocate_pages(0x4000); // 16KB
+        spdlog::info("allocate_pages");
+        struct {
+            unsigned long fd;
+            unsigned long host_addr;
+            unsigned long flash_addr;
+            unsigned long length;
+        } lda{} ;
+
+        auto* scratchpad = driver.get_scratchpad();
+        spdlog::info("get_scratchpad");
+        auto argbuf = scratchpad->allocate(sizeof(lda));
+        spdlog::info("scratchpad->allocate");
+        driver.set_thread_id(1);
+        driver.invoke_function(ctx, 0x1630, argbuf); // test vector
+        memory_space->free_pages(buffer, 0x4000);
+    } else {
+        std::unordered_map<unsigned int, std::unique_ptr<StripedVolume>>
+            volumes;
+        for (auto&& def : host_config.volumes) {
+            std::vector<StripedVolume::Member> members;
+
+            for (auto&& member : def.members) {
+                if (member.device >= drivers.size()) {
+                    spdlog::error("Unknown device {} in volume {}",
+                                  member.device, def.nsid);
+                    return EXIT_FAILURE;
+                }
+
+                members.push_back({drivers[member.device].get(), member.nsid});
+            }
+
+            volumes[def.nsid] =
+                std::make_unique<StripedVolume>(members, def.stripe_size);
+        }
 
-    for (auto&& thread : io_threads)
-        thread->join();
+        int thread_id = 1;
+        std::vector<std::unique_ptr<IOThread>> io_threads;
+        for (auto&& flow : host_config.flows) {
+            auto vit = volumes.find(flow.nsid);
+            if (vit != volumes.end()) {
+                auto* volume = vit->second.get();
+
+                io_threads.emplace_back(IOThread::create_thread(
+                    &driver, volume->get_memory_space(), thread_id,
+                    host_config.sector_size,
+                    volume->get_capacity() / host_config.sector_size, flow));
+                io_threads.back()->set_volume(volume);
+
+                thread_id++;
+                continue;
+            }
+
+            auto it = host_config.namespaces.find(flow.nsid);
+            if (it == host_config.namespaces.end()) {
+                spdlog::error("Unknown namespace {} for flow {}", flow.nsid,
+                              thread_id);
+                return EXIT_FAILURE;
+            }
+
+            const auto& ns = it->second;
+
+            auto ns_info = driver.get_namespace_info(flow.nsid);
+            if (host_config.sector_size % (1U << ns_info.lba_shift))
+                spdlog::warn("Sector size {} is not a multiple of the {}-byte "
+                             "blocks of namespace {}",
+                             host_config.sector_size, 1U << ns_info.lba_shift,
+                             flow.nsid);
+
+            io_threads.emplace_back(IOThread::create_thread(
+                &driver, memory_space, thread_id, host_config.sector_size,
+                ns.capacity_sects, flow));
+
+            thread_id++;
+        }
 
-    driver.set_thread_id(1);
-    driver.flush(1);
+        telemetry.start();
 
-    HostResult host_result;
-    for (auto&& thread : io_threads)
-        host_result.thread_stats.push_back(thread->get_stats());
+        for (auto&& thread : io_threads)
+            thread->run();
 
-    mcmq::SimResult sim_result;
-    driver.report(sim_result);
+        for (auto&& thread : io_threads)
+            thread->join();
 
-    ResultExporter::export_result(result_file, host_result, sim_result);
-#endif
+        telemetry.stop();
 
-    driver.shutdown();
-    link->stop();
+        driver.set_thread_id(1);
+        driver.flush(1);
+
+        for (auto&& def : host_config.volumes) {
+            for (auto&& member : def.members) {
+                drivers[member.device]->set_thread_id(1);
+                drivers[member.device]->flush(member.nsid);
+            }
+        }
+
+        HostResult host_result;
+        for (auto&& thread : io_threads)
+            host_result.thread_stats.push_back(thread->get_stats());
+
+        host_result.irq_stats = driver.get_irq_stats();
+        host_result.queue_stats = driver.get_queue_stats();
+        host_result.hedge_stats = driver.get_hedge_stats();
+        host_result.telemetry = telemetry.get_telemetry();
+
+        mcmq::SimResult sim_result;
+        driver.report(sim_result);
+
+        ResultExporter::export_result(result_file, host_result, sim_result);
+    }
+
+    if (args.count("trace")) {
+        if (Tracer::enabled())
+            Tracer::export_chrome_trace(args["trace"].as<std::string>());
+        else
+            spdlog::warn("Built without UNVME_TRACE, no trace recorded");
+    }
+
+    for (size_t i = 0; i < drivers.size(); i++) {
+        drivers[i]->shutdown();
+        links[i]->stop();
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -700,11 +700,10 @@ static void mfs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
 
 static void ensure_io_thread()
 {
-    static int thread_id = 1;
     thread_local bool inited = false;
 
     if (!inited) {
-        fs.driver->set_thread_id(thread_id++);
+        fs.driver->bind_thread();
         inited = true;
     }
 }
@@ -724,16 +723,29 @@ static void mfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 {
     ensure_io_thread();
 
-    off_t block_off = off % 0x1000UL;
+    off_t block_off = 0;
     size_t buf_size = size;
-    off -= block_off;
-    buf_size += block_off;
-    buf_size = my_roundup(buf_size, 0x1000UL);
-
     MemorySpace::Address buf;
 
+    /* Without SGL bit buckets the device can only read whole blocks into a
+     * page-aligned bounce buffer. So can it when the covering blocks do not
+     * fit in one command, as the driver then needs to split the read. */
+    bool exact = fs.driver->supports_unaligned_read() &&
+                 my_roundup(off % 0x1000UL + size, 0x1000UL) <=
+                     fs.driver->get_max_transfer_size();
+
+    if (!exact) {
+        block_off = off % 0x1000UL;
+        off -= block_off;
+        buf_size += block_off;
+        buf_size = my_roundup(buf_size, 0x1000UL);
+    }
+
     try {
-        buf = fs.mem_space->allocate_pages(buf_size);
+        if (exact)
+            buf = fs.mem_space->allocate(buf_size, 8);
+        else
+            buf = fs.mem_space->allocate_pages(buf_size);
     } catch (MemorySpace::MemoryNotAvailable&) {
         fuse_reply_err(req, ENOMEM);
         return;
@@ -761,7 +773,14 @@ static void mfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
     Inode& inode = get_inode(ino);
 
-    fs.driver->read_async(inode.nsid, off, buf, buf_size, std::move(callback));
+    try {
+        fs.driver->read_async(inode.nsid, off, buf, buf_size,
+                              std::move(callback));
+    } catch (std::exception&) {
+        /* Nothing was submitted, so the callback will not run. */
+        fs.mem_space->free(buf, buf_size);
+        fuse_reply_err(req, EIO);
+    }
 }
 
 static void mfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf,
@@ -840,8 +859,14 @@ cxxopts::ParseResult parse_arguments(int argc, char* argv[])
             ("mountpoint", "Mount point", cxxopts::value<std::string>())
             ("m,mirror", "Mirror directory", cxxopts::value<std::string>())
             ("N,max-threads", "Maximum number of threads",cxxopts::value<int>()->default_value("8"))
+            ("Q,queues", "Number of I/O queues (default: max-threads)", cxxopts::value<int>())
+            ("queue-binding", "Thread to queue binding (round-robin, cpu)",
+            cxxopts::value<std::string>()->default_value("round-robin"))
             ("g,group", "VFIO group", cxxopts::value<std::string>())
             ("d,device", "PCI device ID", cxxopts::value<std::string>())
+            ("dbbuf", "Use shadow doorbells with EventIdx")
+            ("command-timeout", "Command timeout in milliseconds (0: none)",
+            cxxopts::value<unsigned int>()->default_value("0"))
             ("h,help", "Print help");
         // clang-format on
 
@@ -870,11 +895,15 @@ int main(int argc, char* argv[])
     auto options = parse_arguments(argc, argv);
     int ret;
 
-    int max_threads;
+    int max_threads, nr_queues;
     std::string mountpoint, mirror;
     std::string group, device_id;
+    std::string queue_binding;
     try {
         max_threads = options["max-threads"].as<int>();
+        nr_queues = options.count("queues") ? options["queues"].as<int>()
+                                            : max_threads;
+        queue_binding = options["queue-binding"].as<std::string>();
         mountpoint = options["mountpoint"].as<std::string>();
         mirror = options["mirror"].as<std::string>();
 
@@ -948,7 +977,16 @@ int main(int argc, char* argv[])
     link->map_dma(*memory_space);
     link->start();
 
-    NVMeDriver driver(max_threads, 1024, link.get(), memory_space.get(), false);
+    NVMeDriver driver(nr_queues, 1024, link.get(), memory_space.get(),
+                      options.count("dbbuf"));
+
+    driver.set_command_timeout(options["command-timeout"].as<unsigned int>());
+
+    if (queue_binding == "cpu")
+        driver.set_queue_binding(NVMeDriver::QueueBinding::CPU);
+    else
+        driver.set_queue_binding(NVMeDriver::QueueBinding::ROUND_ROBIN);
+
     driver.start();
 
     fs.driver = &driver;
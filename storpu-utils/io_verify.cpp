@@ -0,0 +1,186 @@
+#include "libunvme/memory_space.h"
+#include "libunvme/nvme_coro.h"
+#include "libunvme/nvme_driver.h"
+#include "libunvme/pcie_link_mcmq.h"
+#include "libunvme/pcie_link_vfio.h"
+
+#include "cxxopts.hpp"
+#include "spdlog/cfg/env.h"
+#include "spdlog/spdlog.h"
+
+#include <vector>
+
+using cxxopts::OptionException;
+
+cxxopts::ParseResult parse_arguments(int argc, char* argv[])
+{
+    try {
+        cxxopts::Options options(argv[0],
+                                 " - Write and read back a namespace range");
+
+        // clang-format off
+        options.add_options()
+            ("b,backend", "Backend type", cxxopts::value<std::string>()->default_value("mcmq"))
+            ("m,memory", "Path to the shared memory file",
+            cxxopts::value<std::string>()->default_value("/dev/shm/ivshmem"))
+            ("g,group", "VFIO group",
+            cxxopts::value<std::string>())
+            ("d,device", "PCI device ID",
+            cxxopts::value<std::string>())
+            ("n,namespace", "Namespace ID",
+            cxxopts::value<unsigned int>()->default_value("1"))
+            ("s,size", "Bytes to verify from the start of the namespace",
+            cxxopts::value<size_t>()->default_value("16777216"))
+            ("i,io-size", "Bytes per command",
+            cxxopts::value<size_t>()->default_value("65536"))
+            ("q,queue-depth", "Number of concurrent tasks",
+            cxxopts::value<unsigned int>()->default_value("32"))
+            ("h,help", "Print help");
+        // clang-format on
+
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help")) {
+            std::cerr << options.help({""}) << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+
+        return result;
+    } catch (const OptionException& e) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Write a pattern that encodes the byte offset to every stride-th chunk
+ * starting at first, and check that it reads back unchanged. */
+static NVMeTask<void> verify_chunks(NVMeExecutor& exec,
+                                    MemorySpace* memory_space,
+                                    unsigned int nsid, size_t io_size,
+                                    size_t first, size_t stride,
+                                    size_t nr_chunks, size_t& errors)
+{
+    auto wbuf = memory_space->allocate_pages(io_size);
+    auto rbuf = memory_space->allocate_pages(io_size);
+    std::vector<uint64_t> pattern(io_size / sizeof(uint64_t));
+    std::vector<uint64_t> data(pattern.size());
+
+    for (size_t i = first; i < nr_chunks; i += stride) {
+        loff_t pos = i * io_size;
+
+        for (size_t j = 0; j < pattern.size(); j++)
+            pattern[j] = pos + j * sizeof(uint64_t);
+
+        memory_space->write(wbuf, pattern.data(), io_size);
+        co_await exec.write(nsid, pos, wbuf, io_size);
+        co_await exec.read(nsid, pos, rbuf, io_size);
+        memory_space->read(rbuf, data.data(), io_size);
+
+        if (data != pattern) {
+            spdlog::error("Data mismatch at offset {}", pos);
+            errors++;
+        }
+    }
+
+    memory_space->free(wbuf, io_size);
+    memory_space->free(rbuf, io_size);
+}
+
+int main(int argc, char* argv[])
+{
+    spdlog::cfg::load_env_levels();
+
+    auto args = parse_arguments(argc, argv);
+
+    std::string backend;
+    unsigned int nsid, queue_depth;
+    size_t size, io_size;
+    try {
+        backend = args["backend"].as<std::string>();
+        nsid = args["namespace"].as<unsigned int>();
+        size = args["size"].as<size_t>();
+        io_size = args["io-size"].as<size_t>();
+        queue_depth = args["queue-depth"].as<unsigned int>();
+    } catch (const OptionException& e) {
+        spdlog::error("Failed to parse options: {}", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    if (!io_size || io_size % sizeof(uint64_t) || !queue_depth) {
+        spdlog::error("Invalid I/O size or queue depth");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<MemorySpace> memory_space;
+    std::unique_ptr<PCIeLink> link;
+
+    if (backend == "mcmq") {
+        std::string shared_memory;
+
+        try {
+            shared_memory = args["memory"].as<std::string>();
+        } catch (const OptionException& e) {
+            spdlog::error("Failed to parse options: {}", e.what());
+            exit(EXIT_FAILURE);
+        }
+
+        memory_space = std::make_unique<SharedMemorySpace>(shared_memory);
+        link = std::make_unique<PCIeLinkMcmq>();
+    } else if (backend == "vfio") {
+        std::string group, device_id;
+
+        try {
+            group = args["group"].as<std::string>();
+            device_id = args["device"].as<std::string>();
+        } catch (const OptionException& e) {
+            spdlog::error("Failed to parse options: {}", e.what());
+            exit(EXIT_FAILURE);
+        }
+
+        /* Two buffers per task on top of the driver's queues. */
+        memory_space = std::make_unique<VfioMemorySpace>(
+            0x1000, 2 * 1024 * 1024 + 2 * queue_depth * io_size);
+        link = std::make_unique<PCIeLinkVfio>(group, device_id);
+    } else {
+        spdlog::error("Unknown backend type: {}", backend);
+        return EXIT_FAILURE;
+    }
+
+    if (!link->init()) {
+        spdlog::error("Failed to initialize PCIe link");
+        return EXIT_FAILURE;
+    }
+
+    link->map_dma(*memory_space);
+    link->start();
+
+    /* The executor reaps its own queue. */
+    NVMeDriver driver(1, 1024, link.get(), memory_space.get(), false);
+    driver.set_completion_mode(1, NVMeDriver::CompletionMode::POLL);
+    driver.start();
+    driver.set_thread_id(1);
+
+    NVMeExecutor exec(&driver);
+    size_t nr_chunks = size / io_size;
+    size_t errors = 0;
+    int ret = EXIT_SUCCESS;
+
+    for (unsigned int i = 0; i < queue_depth && i < nr_chunks; i++)
+        exec.spawn(verify_chunks(exec, memory_space.get(), nsid, io_size, i,
+                                 queue_depth, nr_chunks, errors));
+
+    try {
+        exec.run();
+    } catch (const std::exception& e) {
+        spdlog::error("Verification aborted: {}", e.what());
+        ret = EXIT_FAILURE;
+    }
+
+    if (errors) ret = EXIT_FAILURE;
+    spdlog::info("Verified {} chunks of {} bytes, {} mismatches", nr_chunks,
+                 io_size, errors);
+
+    driver.shutdown();
+    link->stop();
+
+    return ret;
+}